@@ -0,0 +1,167 @@
+/* Microbenchmark for the checksum and CRC32C kernels:
+ * bench [seconds-per-run] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "rlib.h"
+
+/* packet-sized and bulk buffers */
+static const int sizes[] = { 8, 64, 512, 1500, 65536 };
+
+
+
+/**
+ * now() - reads the monotonic clock in seconds
+ */
+static double now (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+/**
+ * verify() - checks a kernel against the byte-at-a-time original
+ * @param ref - reference kernel
+ * @param k - kernel to check
+ * @param buf - random data, at least 4096 + 8 bytes
+ * @returns 0 if every length and alignment agrees, -1 otherwise
+ */
+static int verify (const struct cksum_impl *ref, const struct cksum_impl *k,
+    unsigned char *buf) {
+  static unsigned char ones[4096], zeros[4096];
+  int off, len;
+
+  memset (ones, 0xff, sizeof (ones));
+  for (len = 0; len <= 4096; len++) {
+    if (k->fn (ones, len) != ref->fn (ones, len)
+        || k->fn (zeros, len) != ref->fn (zeros, len))
+      goto bad;
+    for (off = 0; off < 8; off++)
+      if (k->fn (buf + off, len) != ref->fn (buf + off, len))
+        goto bad;
+  }
+  return 0;
+
+ bad:
+  fprintf (stderr, "%s: mismatch with %s at length %d\n",
+      k->name, ref->name, len);
+  return -1;
+}
+
+
+
+/**
+ * verify_crc() - checks a CRC32C kernel against the bitwise one
+ * @param ref - reference kernel
+ * @param k - kernel to check
+ * @param buf - random data, at least 4096 + 8 bytes
+ * @returns 0 if every length and alignment agrees, -1 otherwise
+ */
+static int verify_crc (const struct crc32c_impl *ref,
+    const struct crc32c_impl *k, unsigned char *buf) {
+  int off, len = 9;
+
+  /* the check value from the CRC catalogue */
+  if (k->fn (0, "123456789", 9) != 0xe3069283
+      || k->fn (k->fn (0, "1234", 4), "56789", 5) != 0xe3069283)
+    goto bad;
+  for (len = 0; len <= 4096; len++)
+    for (off = 0; off < 8; off++)
+      if (k->fn (0, buf + off, len) != ref->fn (0, buf + off, len))
+        goto bad;
+  return 0;
+
+ bad:
+  fprintf (stderr, "%s: mismatch with %s at length %d\n",
+      k->name, ref->name, len);
+  return -1;
+}
+
+
+
+/**
+ * header() - prints the buffer sizes above a table of rates
+ * @param what - label for the table
+ */
+static void header (const char *what) {
+  int i;
+
+  printf ("%-8s", what);
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    printf ("%10d", sizes[i]);
+  printf ("   (GB/s)\n");
+}
+
+
+
+int main (int argc, char **argv) {
+  const struct cksum_impl *impl = cksum_impls (), *k;
+  const struct crc32c_impl *crc_impl = crc32c_impls (), *c;
+  double secs = argc > 1 ? atof (argv[1]) : 0.2;
+  unsigned char *buf = malloc (65536 + 8);
+  volatile uint32_t sink = 0;
+  int i, failed = 0;
+
+  srand (1);
+  for (i = 0; i < 65536 + 8; i++)
+    buf[i] = rand ();
+
+  header ("cksum:");
+
+  for (k = impl; k->name; k++) {
+    if (!k->usable) {
+      printf ("%-8s   (not supported by this CPU)\n", k->name);
+      continue;
+    }
+    if (verify (impl, k, buf) < 0) {
+      failed = 1;
+      continue;
+    }
+    printf ("%-8s", k->name);
+    for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+      long n, iters = 0;
+      double start = now (), t;
+      do {
+        for (n = 0; n < 1000; n++)
+          sink += k->fn (buf, sizes[i]);
+        iters += n;
+      } while ((t = now () - start) < secs);
+      printf ("%10.2f", (double) iters * sizes[i] / t / 1e9);
+    }
+    printf ("\n");
+  }
+  printf ("cksum() uses the last supported kernel\n\n");
+
+  header ("crc32c:");
+  for (c = crc_impl; c->name; c++) {
+    if (!c->usable) {
+      printf ("%-8s   (not supported by this CPU)\n", c->name);
+      continue;
+    }
+    if (verify_crc (crc_impl, c, buf) < 0) {
+      failed = 1;
+      continue;
+    }
+    printf ("%-8s", c->name);
+    for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+      long n, iters = 0;
+      double start = now (), t;
+      do {
+        for (n = 0; n < 1000; n++)
+          sink += c->fn (0, buf, sizes[i]);
+        iters += n;
+      } while ((t = now () - start) < secs);
+      printf ("%10.2f", (double) iters * sizes[i] / t / 1e9);
+    }
+    printf ("\n");
+  }
+  printf ("crc32c() uses the last supported kernel\n");
+  return failed;
+}
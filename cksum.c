@@ -0,0 +1,467 @@
+/* Internet checksum (RFC 1071) kernels behind cksum(), and the CRC32C
+ * (Castagnoli) kernels behind crc32c() */
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "rlib.h"
+
+#if defined (__x86_64__) || defined (__i386__)
+# include <immintrin.h>
+# define HAVE_X86_SIMD 1
+#else
+# define HAVE_X86_SIMD 0
+#endif
+
+/*
+ * The kernels all add the buffer up as native-order 16-bit words (a
+ * trailing odd byte padded with a zero byte), which a ones-complement
+ * sum allows: byte-swapping every word just byte-swaps the sum.  So
+ * the complement of the folded native sum is already the checksum in
+ * network byte order, bit for bit what cksum_bytes computes.
+ */
+
+/* 32-bit SIMD lanes each gain at most 2 * 0xffff per block; spill
+ * them into 64-bit lanes well before they could overflow */
+#define SIMD_SPILL 4096
+
+/* below this, setting up vector registers costs more than it saves */
+#define SIMD_MIN 64
+
+/* CRC32C polynomial, bit-reversed as the crc32 instruction uses it */
+#define CRC32C_POLY 0x82f63b78
+
+/* crc_table[k][b]: CRC of byte b followed by k zero bytes, for
+ * slicing-by-8; filled in by crc32c_impls() */
+static uint32_t crc_table[8][256];
+
+
+
+/**
+ * csum_add() - ones-complement addition of two 64-bit partial sums
+ */
+static inline uint64_t csum_add (uint64_t a, uint64_t b) {
+  a += b;
+  return a + (a < b);
+}
+
+
+
+/**
+ * csum_final() - folds a partial sum and complements it
+ * @param sum - ones-complement sum of native-order 16-bit words
+ * @returns checksum in network byte order, never 0
+ */
+static inline uint16_t csum_final (uint64_t sum) {
+  uint16_t r;
+
+  sum = (sum >> 32) + (sum & 0xffffffff);
+  sum = (sum >> 32) + (sum & 0xffffffff);
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum = (sum >> 16) + (sum & 0xffff);
+  r = ~sum;
+  return r ? r : 0xffff;
+}
+
+
+
+/**
+ * csum_word() - adds a buffer up eight bytes at a time
+ * @param p - data
+ * @param len - size of data
+ * @returns partial sum, for csum_final
+ */
+static uint64_t csum_word (const uint8_t *p, size_t len) {
+  uint64_t sum = 0, w0, w1, w2, w3;
+  uint32_t w32;
+  uint16_t w16;
+
+  for (; len >= 32; p += 32, len -= 32) {
+    memcpy (&w0, p, 8);
+    memcpy (&w1, p + 8, 8);
+    memcpy (&w2, p + 16, 8);
+    memcpy (&w3, p + 24, 8);
+    sum = csum_add (sum, w0);
+    sum = csum_add (sum, w1);
+    sum = csum_add (sum, w2);
+    sum = csum_add (sum, w3);
+  }
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy (&w0, p, 8);
+    sum = csum_add (sum, w0);
+  }
+  if (len >= 4) {
+    memcpy (&w32, p, 4);
+    sum = csum_add (sum, w32);
+    p += 4;
+    len -= 4;
+  }
+  if (len >= 2) {
+    memcpy (&w16, p, 2);
+    sum = csum_add (sum, w16);
+    p += 2;
+    len -= 2;
+  }
+  if (len) {
+    uint8_t last[2] = { p[0], 0 };
+    memcpy (&w16, last, 2);
+    sum = csum_add (sum, w16);
+  }
+  return sum;
+}
+
+
+
+#if HAVE_X86_SIMD
+/**
+ * csum_sse2() - adds a buffer up sixteen bytes at a time
+ * @param p - data
+ * @param len - size of data
+ * @returns partial sum, for csum_final
+ */
+__attribute__ ((target ("sse2")))
+static uint64_t csum_sse2 (const uint8_t *p, size_t len) {
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i acc64 = zero;
+  uint64_t lane[2];
+
+  if (len < SIMD_MIN)
+    return csum_word (p, len);
+  while (len >= 16) {
+    size_t n = len / 16 < SIMD_SPILL ? len / 16 : SIMD_SPILL;
+    __m128i acc32 = zero;
+
+    len -= n * 16;
+    for (; n; n--, p += 16) {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) p);
+      acc32 = _mm_add_epi32 (acc32, _mm_unpacklo_epi16 (x, zero));
+      acc32 = _mm_add_epi32 (acc32, _mm_unpackhi_epi16 (x, zero));
+    }
+    acc64 = _mm_add_epi64 (acc64, _mm_unpacklo_epi32 (acc32, zero));
+    acc64 = _mm_add_epi64 (acc64, _mm_unpackhi_epi32 (acc32, zero));
+  }
+  _mm_storeu_si128 ((__m128i *) lane, acc64);
+  return csum_add (csum_add (lane[0], lane[1]), csum_word (p, len));
+}
+
+
+
+/**
+ * csum_avx2() - adds a buffer up thirty-two bytes at a time
+ * @param p - data
+ * @param len - size of data
+ * @returns partial sum, for csum_final
+ */
+__attribute__ ((target ("avx2")))
+static uint64_t csum_avx2 (const uint8_t *p, size_t len) {
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i acc64 = zero;
+  uint64_t lane[4];
+
+  if (len < SIMD_MIN)
+    return csum_word (p, len);
+  while (len >= 32) {
+    size_t n = len / 32 < SIMD_SPILL ? len / 32 : SIMD_SPILL;
+    __m256i acc32 = zero;
+
+    len -= n * 32;
+    for (; n; n--, p += 32) {
+      __m256i x = _mm256_loadu_si256 ((const __m256i *) p);
+      acc32 = _mm256_add_epi32 (acc32, _mm256_unpacklo_epi16 (x, zero));
+      acc32 = _mm256_add_epi32 (acc32, _mm256_unpackhi_epi16 (x, zero));
+    }
+    acc64 = _mm256_add_epi64 (acc64, _mm256_unpacklo_epi32 (acc32, zero));
+    acc64 = _mm256_add_epi64 (acc64, _mm256_unpackhi_epi32 (acc32, zero));
+  }
+  _mm256_storeu_si256 ((__m256i *) lane, acc64);
+  return csum_add (csum_add (csum_add (lane[0], lane[1]),
+        csum_add (lane[2], lane[3])), csum_word (p, len));
+}
+#endif
+
+
+
+/**
+ * cksum_bytes() - the original two-bytes-at-a-time checksum
+ * @param _data - data to checksum
+ * @param len - size of buffer, under 128 KiB
+ * @returns 1's complement checksum value
+ */
+static uint16_t cksum_bytes (const void *_data, int len) {
+  const uint8_t *data = _data;
+  uint32_t sum;
+
+  for (sum = 0;len >= 2; data += 2, len -= 2)
+    sum += data[0] << 8 | data[1];
+  if (len > 0)
+    sum += data[0] << 8;
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  sum = htons (~sum);
+  return sum ? sum : 0xffff;
+}
+
+static uint16_t cksum_word (const void *data, int len) {
+  return csum_final (csum_word (data, len));
+}
+
+#if HAVE_X86_SIMD
+__attribute__ ((target ("sse2")))
+static uint16_t cksum_sse2 (const void *data, int len) {
+  return csum_final (csum_sse2 (data, len));
+}
+
+__attribute__ ((target ("avx2")))
+static uint16_t cksum_avx2 (const void *data, int len) {
+  return csum_final (csum_avx2 (data, len));
+}
+#endif
+
+
+
+/**
+ * cksum_update32() - patches a checksum for a changed 32-bit field
+ * @param sum - checksum as stored in the packet
+ * @param from - old field value, as stored (network byte order)
+ * @param to - new field value, as stored
+ * @returns the checksum cksum() would now compute over the packet
+ *
+ * RFC 1624 eqn. 3, HC' = ~(~HC + ~m + m'), applied to both halves of
+ * the field, with cksum()'s convention of never returning 0.
+ */
+uint16_t cksum_update32 (uint16_t sum, uint32_t from, uint32_t to) {
+  uint32_t s = (uint16_t) ~sum;
+  uint16_t r;
+
+  s += (uint16_t) ~(from >> 16);
+  s += (uint16_t) ~from;
+  s += to >> 16;
+  s += (uint16_t) to;
+  s = (s >> 16) + (s & 0xffff);
+  s = (s >> 16) + (s & 0xffff);
+  r = ~s;
+  return r ? r : 0xffff;
+}
+
+
+
+/**
+ * cksum_concat() - combines the checksums of two adjacent buffers
+ * @param first - cksum() of the first buffer, which must be of even size
+ * @param second - cksum() of the buffer that follows it
+ * @returns cksum() of both buffers together
+ */
+uint16_t cksum_concat (uint16_t first, uint16_t second) {
+  return csum_final ((uint16_t) ~first + (uint16_t) ~second);
+}
+
+
+
+/**
+ * cksum_impls() - lists the checksum kernels, least preferred first
+ * @returns array terminated by a NULL name
+ *
+ * sse2 ranks below word64: widening every 16-bit word into a 32-bit
+ * lane costs more than the scalar loop's 64-bit adds with carry, and
+ * make bench shows it slower at every size.
+ */
+const struct cksum_impl * cksum_impls (void) {
+  static struct cksum_impl impl[] = {
+    { "bytes", cksum_bytes, 1 },
+#if HAVE_X86_SIMD
+    { "sse2", cksum_sse2, 0 },
+#endif
+    { "word64", cksum_word, 1 },
+#if HAVE_X86_SIMD
+    { "avx2", cksum_avx2, 0 },
+#endif
+    { NULL, NULL, 0 }
+  };
+  static int checked;
+
+  if (!checked) {
+#if HAVE_X86_SIMD
+    __builtin_cpu_init ();
+    impl[1].usable = __builtin_cpu_supports ("sse2");
+    impl[3].usable = __builtin_cpu_supports ("avx2");
+#endif
+    checked = 1;
+  }
+  return impl;
+}
+
+
+
+/**
+ * crc_bits() - the textbook bit-at-a-time CRC32C
+ * @param crc - CRC so far, not yet complemented
+ * @param p - data
+ * @param len - size of data
+ * @returns CRC including p, not yet complemented
+ */
+static uint32_t crc_bits (uint32_t crc, const uint8_t *p, size_t len) {
+  int k;
+
+  while (len--) {
+    crc ^= *p++;
+    for (k = 0; k < 8; k++)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+  }
+  return crc;
+}
+
+
+
+/**
+ * crc_slice8() - table-driven CRC32C, eight bytes per step
+ * @param crc - CRC so far, not yet complemented
+ * @param p - data
+ * @param len - size of data
+ * @returns CRC including p, not yet complemented
+ */
+static uint32_t crc_slice8 (uint32_t crc, const uint8_t *p, size_t len) {
+  for (; len >= 8; p += 8, len -= 8) {
+    crc ^= p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+    crc = crc_table[7][crc & 0xff] ^ crc_table[6][(crc >> 8) & 0xff]
+      ^ crc_table[5][(crc >> 16) & 0xff] ^ crc_table[4][crc >> 24]
+      ^ crc_table[3][p[4]] ^ crc_table[2][p[5]]
+      ^ crc_table[1][p[6]] ^ crc_table[0][p[7]];
+  }
+  while (len--)
+    crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+
+
+#if HAVE_X86_SIMD
+/**
+ * crc_sse42() - CRC32C with the SSE4.2 crc32 instruction
+ * @param crc - CRC so far, not yet complemented
+ * @param p - data
+ * @param len - size of data
+ * @returns CRC including p, not yet complemented
+ */
+__attribute__ ((target ("sse4.2")))
+static uint32_t crc_sse42 (uint32_t crc, const uint8_t *p, size_t len) {
+  uint32_t w32;
+#ifdef __x86_64__
+  uint64_t c = crc, w;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy (&w, p, 8);
+    c = _mm_crc32_u64 (c, w);
+  }
+  crc = c;
+#endif
+  for (; len >= 4; p += 4, len -= 4) {
+    memcpy (&w32, p, 4);
+    crc = _mm_crc32_u32 (crc, w32);
+  }
+  while (len--)
+    crc = _mm_crc32_u8 (crc, *p++);
+  return crc;
+}
+#endif
+
+
+
+static uint32_t crc32c_bits (uint32_t crc, const void *data, size_t len) {
+  return ~crc_bits (~crc, data, len);
+}
+
+static uint32_t crc32c_slice8 (uint32_t crc, const void *data, size_t len) {
+  return ~crc_slice8 (~crc, data, len);
+}
+
+#if HAVE_X86_SIMD
+__attribute__ ((target ("sse4.2")))
+static uint32_t crc32c_sse42 (uint32_t crc, const void *data, size_t len) {
+  return ~crc_sse42 (~crc, data, len);
+}
+#endif
+
+
+
+/**
+ * crc32c_impls() - lists the CRC32C kernels, least preferred first
+ * @returns array terminated by a NULL name
+ */
+const struct crc32c_impl * crc32c_impls (void) {
+  static struct crc32c_impl impl[] = {
+    { "bitwise", crc32c_bits, 1 },
+    { "slice8", crc32c_slice8, 1 },
+#if HAVE_X86_SIMD
+    { "sse4.2", crc32c_sse42, 0 },
+#endif
+    { NULL, NULL, 0 }
+  };
+  static int checked;
+  int b, k;
+
+  if (!checked) {
+    for (b = 0; b < 256; b++)
+      crc_table[0][b] = crc_bits (b, (const uint8_t *) "", 1);
+    for (k = 1; k < 8; k++)
+      for (b = 0; b < 256; b++)
+        crc_table[k][b] = (crc_table[k - 1][b] >> 8)
+          ^ crc_table[0][crc_table[k - 1][b] & 0xff];
+#if HAVE_X86_SIMD
+    __builtin_cpu_init ();
+    impl[2].usable = __builtin_cpu_supports ("sse4.2");
+#endif
+    checked = 1;
+  }
+  return impl;
+}
+
+
+
+/**
+ * crc32c() - calculates or continues the CRC32C of a data buffer
+ * @param crc - 0 to start, else the CRC of the data before this buffer
+ * @param data - data to checksum
+ * @param len - size of buffer
+ * @returns CRC32C (initial value and final xor all ones), host byte order
+ *
+ * Uses the most preferred kernel the CPU supports, the last usable one
+ * in crc32c_impls(), picked on the first call, which the server makes
+ * before it starts any worker threads.
+ */
+uint32_t crc32c (uint32_t crc, const void *data, size_t len) {
+  static uint32_t (*best) (uint32_t, const void *, size_t);
+
+  if (!best) {
+    const struct crc32c_impl *i;
+    for (i = crc32c_impls (); i->name; i++)
+      if (i->usable)
+        best = i->fn;
+  }
+  return best (crc, data, len);
+}
+
+
+
+/**
+ * cksum() - calculates 16-bit checksum on a data buffer
+ * @param _data - data to checksum
+ * @param len - size of buffer
+ * @returns 1's complement checksum value
+ *
+ * Uses the most preferred kernel the CPU supports, the last usable one
+ * in cksum_impls(), picked on the first call, which the server makes
+ * before it starts any worker threads.
+ */
+uint16_t cksum (const void *_data, int len) {
+  static uint16_t (*best) (const void *, int);
+
+  if (!best) {
+    const struct cksum_impl *i;
+    for (i = cksum_impls (); i->name; i++)
+      if (i->usable)
+        best = i->fn;
+  }
+  return best (_data, len);
+}
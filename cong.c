@@ -0,0 +1,432 @@
+/* Congestion control behind struct cong: NewReno (RFC 6582, RFC 5681),
+ * CUBIC (RFC 9438) and a BBR (v1) style model-based sender, in units of
+ * packets rather than bytes */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "rlib.h"
+
+#define CONG_IW 10                /* initial window (RFC 6928) */
+#define CONG_MINWND 2             /* floor after a loss */
+
+#define CUBIC_C 0.4               /* scaling constant, packets/s^3 */
+#define CUBIC_BETA 0.7            /* multiplicative decrease */
+
+#define BBR_HIGH_GAIN 2.885       /* 2/ln 2: doubles the rate each round */
+#define BBR_CYCLE 8               /* phases of the probe_bw gain cycle */
+#define BBR_MINWND 4              /* cwnd in probe_rtt, and its floor */
+#define BBR_MINRTT_WIN 10000      /* ms a min RTT sample stays good */
+#define BBR_PROBE_RTT_TIME 200    /* ms spent at BBR_MINWND to measure it */
+
+enum { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT };
+
+
+
+/**
+ * reno_ack() - slow start, then one packet per window of acks
+ * @param cg - congestion state
+ * @param acked - # of packets newly acknowledged
+ * @param srtt - smoothed RTT (unused)
+ * @param now - current time (unused)
+ */
+static void reno_ack (struct cong *cg, int acked, long srtt, uint64_t now) {
+  if (cg->cwnd < cg->ssthresh)
+    cg->cwnd += acked;
+  else
+    cg->cwnd += (double) acked / cg->cwnd;
+}
+
+
+
+/**
+ * reno_loss() - halves the window
+ * @param cg - congestion state
+ * @param now - current time (unused)
+ */
+static void reno_loss (struct cong *cg, uint64_t now) {
+  cg->ssthresh = cg->cwnd / 2 > CONG_MINWND ? cg->cwnd / 2 : CONG_MINWND;
+  cg->cwnd = cg->ssthresh;
+}
+
+
+
+/**
+ * reno_timeout() - halves ssthresh and slow starts from one packet
+ * @param cg - congestion state
+ * @param now - current time (unused)
+ */
+static void reno_timeout (struct cong *cg, uint64_t now) {
+  reno_loss (cg, now);
+  cg->cwnd = 1;
+}
+
+
+
+/**
+ * cubic_reduce() - remembers where the window was and shrinks it
+ * @param cg - congestion state
+ *
+ * With fast convergence, a flow losing again before regaining its old
+ * plateau gives up some more, leaving room for newer flows.
+ */
+static void cubic_reduce (struct cong *cg) {
+  if (cg->cwnd < cg->wmax)
+    cg->wmax = cg->cwnd * (1 + CUBIC_BETA) / 2;
+  else
+    cg->wmax = cg->cwnd;
+  cg->ssthresh = cg->cwnd * CUBIC_BETA;
+  if (cg->ssthresh < CONG_MINWND)
+    cg->ssthresh = CONG_MINWND;
+  cg->epoch = 0;
+}
+
+
+
+/**
+ * cubic_ack() - grows the window along the cubic curve
+ * @param cg - congestion state
+ * @param acked - # of packets newly acknowledged
+ * @param srtt - smoothed RTT in microseconds, 0 if unknown
+ * @param now - current time
+ *
+ * The curve is W(t) = C (t - K)^3 + origin, t seconds into the epoch;
+ * the window is steered to where the curve will be one RTT from now,
+ * but never below what Reno would have reached in the meantime.
+ */
+static void cubic_ack (struct cong *cg, int acked, long srtt, uint64_t now) {
+  double t, target;
+
+  if (cg->cwnd < cg->ssthresh) {
+    cg->cwnd += acked;
+    return;
+  }
+  if (!cg->epoch) {
+    cg->epoch = now;
+    if (cg->cwnd < cg->wmax) {
+      cg->k = cbrt ((cg->wmax - cg->cwnd) / CUBIC_C);
+      cg->origin = cg->wmax;
+    }
+    else {
+      cg->k = 0;
+      cg->origin = cg->cwnd;
+    }
+    cg->west = cg->cwnd;
+  }
+
+  t = (now - cg->epoch) / 1e3 + srtt / 1e6 - cg->k;
+  target = cg->origin + CUBIC_C * t * t * t;
+  if (target > 1.5 * cg->cwnd)
+    target = 1.5 * cg->cwnd;
+  if (target > cg->cwnd)
+    cg->cwnd += (target - cg->cwnd) / cg->cwnd * acked;
+  else
+    cg->cwnd += 0.01 * acked / cg->cwnd;
+
+  cg->west += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cg->cwnd;
+  if (cg->west > cg->cwnd)
+    cg->cwnd = cg->west;
+}
+
+
+
+/**
+ * cubic_loss() - multiplicative decrease by CUBIC_BETA
+ * @param cg - congestion state
+ * @param now - current time (unused)
+ */
+static void cubic_loss (struct cong *cg, uint64_t now) {
+  cubic_reduce (cg);
+  cg->cwnd = cg->ssthresh;
+}
+
+
+
+/**
+ * cubic_timeout() - slow starts from one packet up to the reduced window
+ * @param cg - congestion state
+ * @param now - current time (unused)
+ */
+static void cubic_timeout (struct cong *cg, uint64_t now) {
+  cubic_reduce (cg);
+  cg->cwnd = 1;
+}
+
+
+
+/**
+ * bbr_rate() - updates the path model from a delivery rate sample
+ * @param cg - congestion state
+ * @param rs - the sample
+ * @param now - current time
+ *
+ * The bottleneck bandwidth is the highest delivery rate seen in the
+ * last BBR_BW_ROUNDS round trips, the propagation delay the lowest RTT
+ * in the last BBR_MINRTT_WIN ms.  Their product, the BDP, is what the
+ * path holds without queueing; pacing at the bandwidth keeps it there,
+ * with gains above and below 1 to probe for more and drain the excess.
+ */
+static void bbr_rate (struct cong *cg, const struct rate_sample *rs,
+    uint64_t now) {
+  static const double cycle_gain[BBR_CYCLE] = {
+    1.25, 0.75, 1, 1, 1, 1, 1, 1
+  };
+  int expired = cg->minrtt && now - cg->minrtt_at > BBR_MINRTT_WIN;
+  int i, newround = 0;
+  double bw = 0, bdp, pacing_gain, cwnd_gain;
+
+  /* a round trip ends once a packet sent after it began is delivered */
+  if (rs->prior >= cg->round_end) {
+    cg->round_end = rs->delivered;
+    cg->round++;
+    cg->bw_round[cg->round % BBR_BW_ROUNDS] = 0;
+    newround = 1;
+  }
+  if (rs->rate > cg->bw_round[cg->round % BBR_BW_ROUNDS])
+    cg->bw_round[cg->round % BBR_BW_ROUNDS] = rs->rate;
+  for (i = 0; i < BBR_BW_ROUNDS; i++)
+    if (cg->bw_round[i] > bw)
+      bw = cg->bw_round[i];
+  if (rs->rtt > 0 && (!cg->minrtt || rs->rtt <= cg->minrtt || expired)) {
+    cg->minrtt = rs->rtt;
+    cg->minrtt_at = now;
+  }
+  bdp = bw * cg->minrtt / 1e6;
+
+  switch (cg->mode) {
+    case BBR_STARTUP:
+      /* the pipe is full once three rounds fail to grow bw by 25% */
+      if (newround && bw >= cg->full_bw * 1.25) {
+        cg->full_bw = bw;
+        cg->full_rounds = 0;
+      }
+      else if (newround && ++cg->full_rounds >= 3)
+        cg->mode = BBR_DRAIN;
+      break;
+    case BBR_DRAIN:
+      if (rs->inflight <= bdp) {
+        cg->mode = BBR_PROBE_BW;
+        cg->cycle = 2;
+        cg->cycle_at = now;
+      }
+      break;
+    case BBR_PROBE_BW:
+      /* a phase lasts a min RTT; draining stops once the queue is gone */
+      if (now - cg->cycle_at > cg->minrtt / 1000
+          || (cg->cycle == 1 && rs->inflight <= bdp)) {
+        cg->cycle = (cg->cycle + 1) % BBR_CYCLE;
+        cg->cycle_at = now;
+      }
+      break;
+    case BBR_PROBE_RTT:
+      /* hold the window down for a while once it has drained to it */
+      if (!cg->probe_end && rs->inflight <= BBR_MINWND)
+        cg->probe_end = now + BBR_PROBE_RTT_TIME;
+      else if (cg->probe_end && now >= cg->probe_end) {
+        cg->minrtt_at = now;
+        cg->mode = cg->full_rounds >= 3 ? BBR_PROBE_BW : BBR_STARTUP;
+        cg->cycle_at = now;
+      }
+      break;
+  }
+  /* the min RTT has not been seen for a while: let the queue empty so
+   * that it can be measured again */
+  if (expired && cg->mode != BBR_PROBE_RTT) {
+    cg->mode = BBR_PROBE_RTT;
+    cg->probe_end = 0;
+  }
+
+  switch (cg->mode) {
+    case BBR_STARTUP:
+      pacing_gain = cwnd_gain = BBR_HIGH_GAIN;
+      break;
+    case BBR_DRAIN:
+      pacing_gain = 1 / BBR_HIGH_GAIN;
+      cwnd_gain = BBR_HIGH_GAIN;
+      break;
+    case BBR_PROBE_BW:
+      pacing_gain = cycle_gain[cg->cycle];
+      cwnd_gain = 2;
+      break;
+    default:
+      pacing_gain = 1;
+      cwnd_gain = 0;
+      break;
+  }
+  cg->pacing = pacing_gain * bw;
+  cg->target = cwnd_gain * bdp;
+  if (cg->target < BBR_MINWND)
+    cg->target = BBR_MINWND;
+}
+
+
+
+/**
+ * bbr_ack() - moves cwnd toward the model's target
+ * @param cg - congestion state
+ * @param acked - # of packets newly acknowledged
+ * @param srtt - smoothed RTT (unused)
+ * @param now - current time (unused)
+ *
+ * Until the pipe is first full the window only grows, as in slow start;
+ * after that it follows the target down as well as up.
+ */
+static void bbr_ack (struct cong *cg, int acked, long srtt, uint64_t now) {
+  if (!cg->target)
+    cg->cwnd += acked;
+  else if (cg->mode == BBR_STARTUP) {
+    if (cg->cwnd < cg->target)
+      cg->cwnd += acked;
+  }
+  else {
+    cg->cwnd += acked;
+    if (cg->cwnd > cg->target)
+      cg->cwnd = cg->target;
+  }
+}
+
+
+
+/**
+ * bbr_loss() - nothing: the model, not losses, sets the rate
+ * @param cg - congestion state
+ * @param now - current time (unused)
+ */
+static void bbr_loss (struct cong *cg, uint64_t now) {
+}
+
+
+
+/**
+ * bbr_timeout() - restarts from one packet, regrowing to the target
+ * @param cg - congestion state
+ * @param now - current time (unused)
+ */
+static void bbr_timeout (struct cong *cg, uint64_t now) {
+  cg->cwnd = 1;
+}
+
+
+
+const struct cong_ops cong_algos[] = {
+  { "newreno", reno_ack, reno_loss, reno_timeout, NULL },
+  { "cubic", cubic_ack, cubic_loss, cubic_timeout, NULL },
+  { "bbr", bbr_ack, bbr_loss, bbr_timeout, bbr_rate },
+  { NULL }
+};
+
+
+
+/**
+ * cong_find() - looks up a congestion control algorithm by name
+ * @param name - as given to -C
+ * @returns its operations, or NULL if there is no such algorithm
+ */
+const struct cong_ops * cong_find (const char *name) {
+  const struct cong_ops *ops;
+
+  for (ops = cong_algos; ops->name; ops++)
+    if (!strcmp (ops->name, name))
+      return ops;
+  return NULL;
+}
+
+
+
+/**
+ * cong_init() - starts a session's congestion state
+ * @param cg - congestion state
+ * @param ops - algorithm, or NULL for none
+ * @param limit - the configured window
+ */
+void cong_init (struct cong *cg, const struct cong_ops *ops, int limit) {
+  memset (cg, 0, sizeof (*cg));
+  cg->ops = ops;
+  cg->limit = limit;
+  cg->cwnd = CONG_IW < limit ? CONG_IW : limit;
+  cg->ssthresh = limit;
+}
+
+
+
+/**
+ * cong_window() - the # of packets the session may have in flight
+ * @param cg - congestion state
+ * @returns min (cwnd, configured window), at least 1
+ */
+int cong_window (const struct cong *cg) {
+  if (!cg->ops || cg->cwnd >= cg->limit)
+    return cg->limit;
+  return cg->cwnd >= 1 ? (int) cg->cwnd : 1;
+}
+
+
+
+/**
+ * cong_ack() - reports packets newly acknowledged
+ * @param cg - congestion state
+ * @param acked - # of packets, cumulatively or selectively
+ * @param srtt - smoothed RTT in microseconds, 0 if unknown
+ * @param now - current time
+ *
+ * cwnd does not grow past the configured window, which would only
+ * leave it too large to react when a loss finally comes.
+ */
+void cong_ack (struct cong *cg, int acked, long srtt, uint64_t now) {
+  if (!cg->ops || acked <= 0)
+    return;
+  cg->ops->on_ack (cg, acked, srtt, now);
+  if (cg->cwnd > cg->limit)
+    cg->cwnd = cg->limit;
+}
+
+
+
+/**
+ * cong_loss() - reports a loss detected while acks still flow
+ * @param cg - congestion state
+ * @param now - current time
+ */
+void cong_loss (struct cong *cg, uint64_t now) {
+  if (cg->ops)
+    cg->ops->on_loss (cg, now);
+}
+
+
+
+/**
+ * cong_timeout() - reports a retransmission timeout
+ * @param cg - congestion state
+ * @param now - current time
+ */
+void cong_timeout (struct cong *cg, uint64_t now) {
+  if (cg->ops)
+    cg->ops->on_timeout (cg, now);
+}
+
+
+
+/**
+ * cong_rate() - reports a delivery rate sample, ahead of its cong_ack
+ * @param cg - congestion state
+ * @param rs - the sample
+ * @param now - current time
+ */
+void cong_rate (struct cong *cg, const struct rate_sample *rs, uint64_t now) {
+  if (cg->ops && cg->ops->on_rate)
+    cg->ops->on_rate (cg, rs, now);
+}
+
+
+
+/**
+ * cong_pacing() - the rate at which to space new packets
+ * @param cg - congestion state
+ * @returns packets per second, 0 to send them as the window allows
+ */
+double cong_pacing (const struct cong *cg) {
+  return cg->ops ? cg->pacing : 0;
+}
@@ -31,6 +31,39 @@
 
 #define DATA_HDRLEN 12
 #define ACK_HDRLEN   8
+#define SACK_HDRLEN (DATA_HDRLEN + (int) sizeof (struct sack_block))
+#define MAX_PKTLEN  (DATA_HDRLEN + (int) sizeof (((packet_t *) 0)->data))
+#define CRC_LEN      4             // CRC32C trailer with -c, outside len
+#define MAP_SLOTLEN (DATA_HDRLEN + CRC_LEN)  // slot storage for mapped input
+
+#define RTO_MIN      10            // floor on the computed RTO, milliseconds
+#define RTO_MAX   60000            // ceiling on the backed-off RTO
+#define MAX_BACKOFF   6            // RTO doubles at most 2^6 times
+#define PACE_QUANTUM 250           // microseconds a paced packet may be early
+#define TLP_MIN       2            // floor on the tail loss probe timeout, ms
+#define ACK_EVERY     2            // in-order packets covered by one ack
+#define ACK_DELAY     2            // ms an ack may wait for the next packet
+#define LINGER_RTOS   2            // RTOs a finished session waits for the
+                                   // peer to resend an EOF whose ack was lost
+
+
+/*
+ * in-flight data packet awaiting acknowledgement
+ */
+struct sendSlot {
+  packet_t *pkt;                   // packet as sent, network byte order;
+                                   // just header and CRC if mapped is set
+  const char *mapped;              // payload in the input mapping, or NULL
+  size_t len;                      // # of bytes on the wire
+  rdt_t *r;                        // connection owning the slot
+  struct rtimer timer;             // retransmission deadline
+  struct timespec sentAt;          // time of last (re)transmission
+  int sacked;                      // receiver reported holding this packet
+  int counted;                     // already counted in r->delivered
+  int retransmitted;               // sent more than once (Karn: no RTT sample)
+  uint64_t delivered;              // r->delivered when last sent
+  struct timespec deliveredAt;     // r->deliveredAt when last sent
+};
 
 
 /*
@@ -40,23 +73,803 @@ struct reliable_state {
   rdt_t *next;			         // this is a linked list of active connections
   rdt_t **prev;
   conn_t *c;			           // rlib connection object
-  int sentSeqno;
-  int recvdSeqno;
-  struct timespec * ackTimestamp;
-  struct timespec * dataTimestamp;
-  int sentAckno;
-  int recvdAckno;
-  packet_t * lastDataPktSent;
-  packet_t * lastAckPktSent;
-  packet_t * lastDataPktRecvd;
-  packet_t * overflowBuf;
+  struct sockaddr_storage peer;    // server only: client address, the demux key
+  unsigned int peerHash;           // addrhash(&peer)
+  int demuxed;                     // linked into demux_table
+  size_t trailer;                  // CRC_LEN with -c, else 0
+  int window;                      // max # of unacked data packets in flight
+  struct cong cong;                // congestion window, within window
+  long timeout;                    // initial and maximum RTO in milliseconds
+  long srtt;                       // smoothed RTT in microseconds, 0 if unknown
+  long rttvar;                     // RTT variation in microseconds
+  long rto;                        // current RTO in milliseconds, before backoff
+  int backoff;                     // # of RTO doublings since the last sample
+  struct timespec backoffAt;       // time of the last doubling
+  int dupThresh;                   // dup acks that trigger a fast retransmit,
+                                   // 0 for none
+  int dupAcks;                     // # of acks in a row repeating sendBase
+  int recovering;                  // a fast retransmit is outstanding
+  uint32_t recover;                // nextSeqno when recovery began; it ends
+                                   // once the ackno reaches it
+  struct rtimer tlpTimer;          // tail loss probe deadline
+  int tlpSent;                     // probed since the last new ack
+
+  struct sendSlot *sendRing;       // in-flight packets, indexed by seqno % window
+  char *sendBuf;                   // storage behind the sendRing packets
+  const char *inMap;               // -m: next input in rlib's mapping, or NULL
+  size_t inMapLeft;                // bytes from inMap to the end of input
+  uint32_t sendBase;               // oldest unacknowledged seqno
+  uint32_t nextSeqno;              // seqno of the next new data packet
+  int readEof;                     // our EOF has been queued for sending
+  uint64_t delivered;              // # of packets acked or sacked so far
+  struct timespec deliveredAt;     // when delivered last grew
+  uint64_t paceAt;                 // microseconds: when the next new packet
+                                   // is due, if cong_pacing() is set
+  rdt_t *paceNext;                 // pace_list link
+  int paced;                       // on pace_list, waiting for paceAt
+
+  packet_t *recvRing;              // reorder buffer, indexed by seqno % window
+  uint64_t *recvMap;               // bitmap of recvRing slots holding a packet
+  uint32_t recvNext;               // next in-order seqno expected (our ackno)
+  uint32_t recvHigh;               // one past the highest seqno buffered
+  int recvEof;                     // peer's EOF delivered to conn_output
+  int peerHasAck;                  // peer acked a packet of ours that
+                                   // acked its EOF, so won't resend it
+  int ackPending;                  // # of packets received but not yet acked
+  struct rtimer ackTimer;          // delayed ack deadline
+  struct rtimer closeTimer;        // linger once both directions are done
 };
 
 
 /*
- * global variables
+ * global variables, one set per server worker thread
+ */
+__thread rdt_t *rdt_list;
+static __thread struct twheel rdt_wheel;    // every retransmission deadline
+static __thread rdt_t **demux_table;        // server sessions, open addressing by peer
+static __thread size_t demux_size;          // # of buckets, a power of two
+static __thread size_t demux_count;         // # of sessions in demux_table
+static __thread rdt_t *pace_list;           // sessions held back by pacing
+
+
+
+/**
+ * pkt_len - validates a packet received from the network
+ * @param pkt - received packet, untouched (network byte order)
+ * @param n - # of bytes received
+ * @param trailer - CRC_LEN if packets carry a CRC32C, else 0
+ * @returns the packet's len field, or 0 if it is truncated, malformed
+ *          or corrupted
+ */
+static size_t pkt_len(const packet_t *pkt, size_t n, size_t trailer) {
+  size_t len;
+
+  if (n < ACK_HDRLEN + trailer)
+    return 0;
+  len = ntohs(pkt->len);
+  if (len + trailer > n || len + trailer > MAX_PKTLEN
+      || (len != ACK_HDRLEN && len < DATA_HDRLEN))
+    return 0;
+  if (len != ACK_HDRLEN && pkt->seqno == 0
+      && (len < SACK_HDRLEN || len > sizeof(struct sack_packet)
+          || (len - DATA_HDRLEN) % sizeof(struct sack_block)))
+    return 0;
+  if (trailer) {
+    uint32_t crc;
+
+    memcpy(&crc, (const char *) pkt + len, CRC_LEN);
+    if (pkt->cksum != 0 || ntohl(crc) != crc32c(0, pkt, len))
+      return 0;
+  }
+  //summing a packet including its own checksum yields all ones
+  else if (cksum(pkt, len) != 0xffff)
+    return 0;
+  return len;
+}
+
+
+
+/**
+ * pkt_seal - fills in a packet's checksum, or its CRC32C trailer with -c
+ * @param r - reliable connection state information
+ * @param pkt - packet with every other header field set, and room for
+ *              the trailer after what it holds of the packet
+ * @param mapped - the payload, if not in pkt but in the input mapping
+ * @param len - the packet's len field (host byte order)
+ * @returns # of bytes to put on the wire
+ */
+static size_t pkt_seal(const rdt_t *r, packet_t *pkt, const char *mapped, size_t len) {
+  size_t held = mapped ? DATA_HDRLEN : len;
+  uint32_t crc;
+
+  pkt->cksum = 0;
+  if (!r->trailer) {
+    pkt->cksum = cksum(pkt, held);
+    if (mapped)
+      pkt->cksum = cksum_concat(pkt->cksum, cksum(mapped, len - held));
+    return len;
+  }
+  crc = crc32c(0, pkt, held);
+  if (mapped)
+    crc = crc32c(crc, mapped, len - held);
+  crc = htonl(crc);
+  memcpy((char *) pkt + held, &crc, CRC_LEN);
+  return len + CRC_LEN;
+}
+
+
+
+/*
+ * receive bitmap helpers, indexed by seqno
+ */
+static inline int recv_test(const rdt_t *r, uint32_t seqno) {
+  uint32_t i = seqno % r->window;
+  return (r->recvMap[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void recv_set(rdt_t *r, uint32_t seqno) {
+  uint32_t i = seqno % r->window;
+  r->recvMap[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+static inline void recv_clear(rdt_t *r, uint32_t seqno) {
+  uint32_t i = seqno % r->window;
+  r->recvMap[i / 64] &= ~((uint64_t) 1 << (i % 64));
+}
+
+
+
+/**
+ * elapsed_us - microseconds between two CLOCK_MONOTONIC timestamps
+ * @param since - earlier timestamp
+ * @param now - later timestamp
+ * @returns # of microseconds from since to now
+ */
+static long elapsed_us(const struct timespec *since, const struct timespec *now) {
+  return (now->tv_sec - since->tv_sec) * 1000000
+    + (now->tv_nsec - since->tv_nsec) / 1000;
+}
+
+
+
+/**
+ * ts_us - a CLOCK_MONOTONIC timestamp in microseconds
+ * @param ts - timestamp
+ * @returns microseconds since the clock's epoch
+ */
+static uint64_t ts_us(const struct timespec *ts) {
+  return (uint64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+
+
+/**
+ * ack_heard - notes whether the packet in a slot the peer has acked or
+ *             sacked told it that we hold its EOF
+ * @param r - reliable connection state information
+ * @param s - slot the peer reported
+ */
+static void ack_heard(rdt_t *r, const struct sendSlot *s) {
+  //recvNext stops just past the EOF, so only packets sent after it was
+  //delivered carry that ackno
+  if (r->recvEof && ntohl(s->pkt->ackno) == r->recvNext)
+    r->peerHasAck = 1;
+}
+
+
+
+/**
+ * slot_delivered - counts a packet the peer has acked or sacked
+ * @param r - reliable connection state information
+ * @param s - slot that was delivered
+ * @param now - current time
+ * @param latest - the delivered slot sent last so far, updated
+ */
+static void slot_delivered(rdt_t *r, struct sendSlot *s, const struct timespec *now,
+                           struct sendSlot **latest) {
+  s->counted = 1;
+  r->delivered++;
+  r->deliveredAt = *now;
+  if (!*latest || (int64_t) (s->delivered - (*latest)->delivered) > 0)
+    *latest = s;
+}
+
+
+
+/**
+ * rate_sample - reports the delivery rate an ack reveals: the packets
+ *               delivered between the newest one it covers going out
+ *               and now, over that interval
+ * @param r - reliable connection state information
+ * @param s - that newest slot
+ * @param now - current time
+ */
+static void rate_sample(rdt_t *r, const struct sendSlot *s, const struct timespec *now) {
+  struct rate_sample rs;
+  long interval = elapsed_us(&s->deliveredAt, now);
+
+  if (interval <= 0)
+    return;
+  rs.prior = s->delivered;
+  rs.delivered = r->delivered;
+  rs.rate = (double) (rs.delivered - rs.prior) * 1000000 / interval;
+  rs.rtt = s->retransmitted ? 0 : elapsed_us(&s->sentAt, now);
+  rs.inflight = r->nextSeqno - r->sendBase;
+  cong_rate(&r->cong, &rs, clock_ms());
+}
+
+
+
+/**
+ * rtt_sample - folds one RTT measurement into the Jacobson/Karels
+ *              estimator and recomputes the RTO
+ * @param r - reliable connection state information
+ * @param rtt - measured round trip time in microseconds
+ */
+static void rtt_sample(rdt_t *r, long rtt) {
+  long delta;
+
+  if (!r->srtt) {
+    r->srtt = rtt > 0 ? rtt : 1;
+    r->rttvar = rtt / 2;
+  }
+  else {
+    delta = rtt - r->srtt;
+    r->srtt += delta / 8;
+    if (r->srtt <= 0)
+      r->srtt = 1;
+    r->rttvar += ((delta < 0 ? -delta : delta) - r->rttvar) / 4;
+  }
+
+  //the configured timeout caps the estimate; backoff may exceed it
+  r->rto = (r->srtt + 4 * r->rttvar + 999) / 1000;
+  if (r->rto < RTO_MIN)
+    r->rto = RTO_MIN;
+  if (r->rto > r->timeout)
+    r->rto = r->timeout;
+  r->backoff = 0;
+}
+
+
+
+/**
+ * ack_sent - notes that our cumulative ackno has gone out, on its own
+ *            or in a data packet, so no delayed ack is due
+ * @param r - reliable connection state information
+ */
+static void ack_sent(rdt_t *r) {
+  r->ackPending = 0;
+  timer_cancel(&rdt_wheel, &r->ackTimer);
+}
+
+
+
+/**
+ * send_ack - send an ack-only packet carrying our cumulative ackno,
+ *            plus SACK blocks for any runs buffered beyond a gap
+ * @param r - reliable connection state information
+ */
+static void send_ack(rdt_t *r) {
+  struct {
+    struct sack_packet ack;
+    uint32_t crc;                  // room for a trailer after the last block
+  } buf;
+  struct sack_packet *ack = &buf.ack;
+  uint32_t seqno = r->recvNext;
+  int nblocks = 0;
+  size_t len;
+
+  //walk the buffered span after the first gap, one block per run
+  while (nblocks < MAX_SACK_BLOCKS && (int32_t) (r->recvHigh - seqno) > 0) {
+    while (!recv_test(r, seqno))
+      seqno++;
+    ack->sack[nblocks].start = htonl(seqno);
+    while (seqno != r->recvHigh && recv_test(r, seqno))
+      seqno++;
+    ack->sack[nblocks++].end = htonl(seqno);
+  }
+
+  len = nblocks ? DATA_HDRLEN + nblocks * sizeof(ack->sack[0]) : ACK_HDRLEN;
+  ack->len = htons(len);
+  ack->ackno = htonl(r->recvNext);
+  ack->zero = 0;
+  len = pkt_seal(r, (packet_t *) ack, NULL, len);
+  conn_sendpkt(r->c, (packet_t *) ack, len);
+  ack_sent(r);
+}
+
+
+
+/**
+ * ack_timeout - delayed ack timer callback: no second packet came
+ * @param arg - the rdt_t
+ */
+static void ack_timeout(void *arg) {
+  send_ack(arg);
+}
+
+
+
+/**
+ * delay_ack - holds back the ack for an in-order packet, up to ACK_DELAY
+ *             ms, for more packets to cover with the same ack or for
+ *             outgoing data to carry it
+ * @param r - reliable connection state information
+ */
+static void delay_ack(rdt_t *r) {
+  r->ackPending++;
+  if (!timer_pending(&r->ackTimer))
+    timer_set(&rdt_wheel, &r->ackTimer, ACK_DELAY);
+}
+
+
+
+/**
+ * recv_sack - marks in-flight slots covered by SACK blocks so they are
+ *             not retransmitted, and takes an RTT sample from the newest
+ *             newly sacked original transmission.  The oldest packet
+ *             keeps its timer even when sacked: the peer may hold it
+ *             without delivering it, and that timer is the RTO.
+ * @param r - reliable connection state information
+ * @param ack - extended ack packet (host byte order len)
+ */
+static void recv_sack(rdt_t *r, const struct sack_packet *ack) {
+  int nblocks = (ack->len - DATA_HDRLEN) / sizeof(ack->sack[0]);
+  uint32_t inflight = r->nextSeqno - r->sendBase;
+  struct sendSlot *newest = NULL, *latest = NULL;
+  struct timespec now;
+  int i, sacked = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < nblocks; i++) {
+    uint32_t start = ntohl(ack->sack[i].start);
+    uint32_t end = ntohl(ack->sack[i].end);
+    uint32_t seqno;
+
+    //ignore blocks that are not entirely inside the send window
+    if (start - r->sendBase >= inflight || end - start > inflight
+        || end - r->sendBase > inflight)
+      continue;
+    for (seqno = start; seqno != end; seqno++) {
+      struct sendSlot *s = &r->sendRing[seqno % r->window];
+      if (!s->counted && !s->retransmitted
+          && (!newest || elapsed_us(&newest->sentAt, &s->sentAt) > 0))
+        newest = s;
+      if (!s->counted) {
+        slot_delivered(r, s, &now, &latest);
+        sacked++;
+      }
+      s->sacked = 1;
+      ack_heard(r, s);
+      if (seqno != r->sendBase)
+        timer_cancel(&rdt_wheel, &s->timer);
+    }
+  }
+  if (newest)
+    rtt_sample(r, elapsed_us(&newest->sentAt, &now));
+  if (latest)
+    rate_sample(r, latest, &now);
+  cong_ack(&r->cong, sacked, r->srtt, clock_ms());
+}
+
+
+
+/**
+ * current_rto - the retransmission timeout including backoff
+ * @param r - reliable connection state information
+ * @returns RTO in milliseconds
+ */
+static long current_rto(const rdt_t *r) {
+  long rto = r->rto << r->backoff;
+  return rto < RTO_MAX ? rto : RTO_MAX;
+}
+
+
+
+/**
+ * rto_left - time until a slot's retransmission is due under the
+ *            current RTO, which may differ from the one it was armed with
+ * @param r - reliable connection state information
+ * @param s - in-flight slot
+ * @param now - current time
+ * @returns milliseconds left, <= 0 if already due
+ */
+static long rto_left(const rdt_t *r, const struct sendSlot *s, const struct timespec *now) {
+  return current_rto(r) - elapsed_us(&s->sentAt, now) / 1000;
+}
+
+
+
+/**
+ * send_slot - (re)transmit a buffered data packet with a fresh ackno
+ *             and restart its timer
+ * @param r - reliable connection state information
+ * @param s - slot holding the packet
+ * @param now - current time
  */
-rdt_t *rdt_list;
+static void send_slot(rdt_t *r, struct sendSlot *s, const struct timespec *now) {
+  uint32_t ackno = htonl(r->recvNext);
+  double pacing;
+
+  //a resent packet carries our latest ackno; patch the checksum for
+  //the changed field instead of summing the whole packet again.  A CRC
+  //has no such shortcut and is simply recomputed.
+  if (s->pkt->ackno != ackno && r->trailer) {
+    s->pkt->ackno = ackno;
+    pkt_seal(r, s->pkt, s->mapped, ntohs(s->pkt->len));
+  }
+  else if (s->pkt->ackno != ackno) {
+    s->pkt->cksum = cksum_update32(s->pkt->cksum, s->pkt->ackno, ackno);
+    s->pkt->ackno = ackno;
+  }
+  if (s->mapped)
+    conn_sendref(r->c, s->pkt, DATA_HDRLEN + r->trailer, DATA_HDRLEN,
+        s->mapped, s->len - DATA_HDRLEN - r->trailer);
+  else
+    conn_sendpkt(r->c, s->pkt, s->len);
+  ack_sent(r);
+  s->sentAt = *now;
+  timer_set(&rdt_wheel, &s->timer, current_rto(r));
+
+  //snapshot the delivery count for rate samples; after an idle spell
+  //the interval starts now, not at the last delivery
+  if (r->nextSeqno == r->sendBase)
+    r->deliveredAt = *now;
+  s->delivered = r->delivered;
+  s->deliveredAt = r->deliveredAt;
+
+  //every transmission uses up pacing time, retransmissions included
+  pacing = cong_pacing(&r->cong);
+  if (pacing > 0) {
+    uint64_t at = ts_us(now);
+    if ((int64_t) (r->paceAt - at) > 0)
+      at = r->paceAt;
+    r->paceAt = at + (uint64_t) (1000000 / pacing);
+  }
+}
+
+
+
+/**
+ * sack_clear - forgets the SACK scoreboard after an RTO (RFC 6675): the
+ *              sacked packets get their timers back, and are resent as
+ *              they expire unless the peer reports them again first
+ * @param r - reliable connection state information
+ */
+static void sack_clear(rdt_t *r) {
+  uint32_t seqno;
+
+  for (seqno = r->sendBase + 1; seqno != r->nextSeqno; seqno++) {
+    struct sendSlot *s = &r->sendRing[seqno % r->window];
+    if (s->sacked) {
+      s->sacked = 0;
+      timer_set(&rdt_wheel, &s->timer, current_rto(r));
+    }
+  }
+}
+
+
+
+/**
+ * rexmit_timeout - retransmission timer callback for one send slot; the
+ *                  oldest one's expiry is the RTO, which also clears
+ *                  the SACK scoreboard
+ * @param arg - the expired struct sendSlot
+ */
+static void rexmit_timeout(void *arg) {
+  struct sendSlot *s = arg;
+  rdt_t *r = s->r;
+  struct timespec now;
+  long left;
+
+  //a probe may have resent a sacked packet, restarting its timer; only
+  //the oldest one's timer counts then, as the RTO
+  if (s->sacked && s != &r->sendRing[r->sendBase % r->window])
+    return;
+  //the RTO may have grown since the slot was armed; if so, wait out
+  //the difference rather than retransmit early
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  left = rto_left(r, s, &now);
+  if (left > 0) {
+    timer_set(&rdt_wheel, &s->timer, left);
+    return;
+  }
+
+  //back off once per round of expiries (a slot sent after the last
+  //backoff timing out), until a fresh RTT sample arrives; that is also
+  //one timeout as far as congestion control is concerned
+  if (elapsed_us(&r->backoffAt, &s->sentAt) >= 0) {
+    //a peer that has sent its EOF answers every packet, even with its
+    //output full; silence through a whole backoff means it finished,
+    //lingered and left without hearing our last acks
+    if (r->recvEof && r->backoff == MAX_BACKOFF) {
+      rdt_destroy(r);
+      return;
+    }
+    if (r->backoff < MAX_BACKOFF)
+      r->backoff++;
+    r->backoffAt = now;
+    cong_timeout(&r->cong, clock_ms());
+  }
+  if (s == &r->sendRing[r->sendBase % r->window])
+    sack_clear(r);
+  s->retransmitted = 1;
+  send_slot(r, s, &now);
+}
+
+
+
+/**
+ * fast_retransmit - resends the oldest unacknowledged packet ahead of
+ *                   its timer, unless the peer already holds it
+ * @param r - reliable connection state information
+ * @param now - current time
+ */
+static void fast_retransmit(rdt_t *r, const struct timespec *now) {
+  struct sendSlot *s = &r->sendRing[r->sendBase % r->window];
+
+  if (r->sendBase == r->nextSeqno || s->sacked)
+    return;
+  s->retransmitted = 1;
+  send_slot(r, s, now);
+}
+
+
+
+/**
+ * tlp_arm - (re)starts the tail loss probe timer at 2 * SRTT from now,
+ *           when that comes before the RTO, i.e. the oldest packet's
+ *           timer.  Without an RTT sample, during recovery, or once a
+ *           probe is out since the last new ack, the RTO alone stands.
+ * @param r - reliable connection state information
+ * @param now - current time
+ */
+static void tlp_arm(rdt_t *r, const struct timespec *now) {
+  struct sendSlot *s = &r->sendRing[r->sendBase % r->window];
+  long pto = (2 * r->srtt + 999) / 1000;
+  long rto;
+
+  if (pto < TLP_MIN)
+    pto = TLP_MIN;
+  //a lone packet's ack may be held back by the peer's delayed ack
+  if (r->nextSeqno - r->sendBase == 1)
+    pto += ACK_DELAY;
+  //a sacked oldest packet's timer runs from the ack that reached it,
+  //not from its sentAt
+  rto = timer_pending(&s->timer)
+      ? (long) (int64_t) (s->timer.expires - clock_ms()) : rto_left(r, s, now);
+  if (r->sendBase == r->nextSeqno || !r->srtt || r->recovering
+      || r->tlpSent || pto >= rto)
+    timer_cancel(&rdt_wheel, &r->tlpTimer);
+  else
+    timer_set(&rdt_wheel, &r->tlpTimer, pto);
+}
+
+
+
+/**
+ * tlp_timeout - tail loss probe timer callback: the acks have stopped
+ *               without a loss being detected, which is what losing the
+ *               last packets of a burst (often the EOF) looks like, as
+ *               nothing follows them to raise dup acks.  Sends new data
+ *               if the window allows, else resends the newest packet,
+ *               sacked or not (RFC 8985): its ack will settle the tail,
+ *               reveal the hole, or re-advertise a window the peer's
+ *               full output had closed.
+ * @param arg - the rdt_t
+ */
+static void tlp_timeout(void *arg) {
+  rdt_t *r = arg;
+  struct sendSlot *s = &r->sendRing[(r->nextSeqno - 1) % r->window];
+  uint32_t next = r->nextSeqno;
+  struct timespec now;
+
+  if (r->sendBase == r->nextSeqno)
+    return;
+  r->tlpSent = 1;
+  if (!r->readEof)
+    rdt_read(r);
+  if (r->nextSeqno != next)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  s->retransmitted = 1;
+  send_slot(r, s, &now);
+}
+
+
+
+/**
+ * recv_dupack - counts acks that repeat sendBase while data is in
+ *               flight; the dupThresh-th one starts a recovery, which
+ *               resends the missing packet and tells congestion control
+ *               of the loss.  Further dup acks until recovery ends are
+ *               ignored, so one loss costs one retransmission.
+ * @param r - reliable connection state information
+ * @param ackno - cumulative ackno of an ack-only packet
+ */
+static void recv_dupack(rdt_t *r, uint32_t ackno) {
+  struct timespec now;
+
+  if (!r->dupThresh || ackno != r->sendBase || r->sendBase == r->nextSeqno)
+    return;
+  if (++r->dupAcks != r->dupThresh || r->recovering)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  r->recovering = 1;
+  r->recover = r->nextSeqno;
+  cong_loss(&r->cong, clock_ms());
+  fast_retransmit(r, &now);
+}
+
+
+
+/**
+ * recv_ack - releases the slots covered by a cumulative ackno, taking
+ *            an RTT sample from the newest of them unless it was
+ *            retransmitted (Karn's rule) or already timed by a SACK
+ * @param r - reliable connection state information
+ * @param ackno - first seqno the peer has not received
+ * @returns 1 if the ackno acknowledged new data, 0 otherwise
+ */
+static int recv_ack(rdt_t *r, uint32_t ackno) {
+  struct sendSlot *s, *latest = NULL;
+  struct timespec now;
+  int acked = 0;
+
+  if (ackno - r->sendBase - 1 >= r->nextSeqno - r->sendBase)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  s = &r->sendRing[(ackno - 1) % r->window];
+  if (!s->retransmitted && !s->counted)
+    rtt_sample(r, elapsed_us(&s->sentAt, &now));
+  for (; r->sendBase != ackno; r->sendBase++) {
+    s = &r->sendRing[r->sendBase % r->window];
+    if (!s->counted) {
+      slot_delivered(r, s, &now, &latest);
+      acked++;
+    }
+    ack_heard(r, s);
+    timer_cancel(&rdt_wheel, &s->timer);
+  }
+  if (latest)
+    rate_sample(r, latest, &now);
+  cong_ack(&r->cong, acked, r->srtt, clock_ms());
+  r->dupAcks = 0;
+
+  //in recovery, an ack short of the recovery point means the packet
+  //after it was lost as well: resend it right away (NewReno)
+  if (r->recovering && (int32_t) (ackno - r->recover) >= 0)
+    r->recovering = 0;
+  else if (r->recovering)
+    fast_retransmit(r, &now);
+  r->tlpSent = 0;
+
+  //re-time the new oldest packet against the current RTO, which may
+  //have shrunk since it was sent.  If it was sacked its timer was
+  //stopped; as the RTO it restarts from this ack.
+  s = &r->sendRing[r->sendBase % r->window];
+  if (timer_pending(&s->timer))
+    timer_set(&rdt_wheel, &s->timer, rto_left(r, s, &now));
+  else if (r->sendBase != r->nextSeqno)
+    timer_set(&rdt_wheel, &s->timer, current_rto(r));
+  tlp_arm(r, &now);
+  return 1;
+}
+
+
+
+/**
+ * close_timeout - linger timer callback: the peer has gone quiet
+ * @param arg - the rdt_t
+ */
+static void close_timeout(void *arg) {
+  rdt_destroy(arg);
+}
+
+
+
+/**
+ * rdt_done - tears down the session once both directions have finished.
+ *            Unless the peer is known to have our ack of its EOF, the
+ *            session first lingers LINGER_RTOS RTOs in case that ack
+ *            was lost and the EOF comes again; each packet arriving
+ *            meanwhile restarts the wait.
+ * @param r - reliable connection state information
+ */
+static void rdt_done(rdt_t *r) {
+  if (r->readEof && r->recvEof && r->sendBase == r->nextSeqno)
+    timer_set(&rdt_wheel, &r->closeTimer,
+              r->peerHasAck ? 0 : LINGER_RTOS * r->rto);
+}
+
+
+
+/**
+ * demux_find - looks up the server session for a client address
+ * @param ss - client address
+ * @param hash - addrhash(ss)
+ * @returns the session, or NULL if there is none
+ */
+static rdt_t *demux_find(const struct sockaddr_storage *ss, unsigned int hash) {
+  size_t mask = demux_size - 1;
+  size_t i;
+  rdt_t *r;
+
+  if (!demux_size)
+    return NULL;
+  for (i = hash & mask; (r = demux_table[i]); i = (i + 1) & mask)
+    if (r->peerHash == hash && addreq(&r->peer, ss))
+      return r;
+  return NULL;
+}
+
+
+
+/**
+ * demux_place - stores a session in the first free bucket of its probe run
+ * @param r - session to store
+ */
+static void demux_place(rdt_t *r) {
+  size_t mask = demux_size - 1;
+  size_t i;
+
+  for (i = r->peerHash & mask; demux_table[i]; i = (i + 1) & mask)
+    ;
+  demux_table[i] = r;
+}
+
+
+
+/**
+ * demux_insert - adds a server session, doubling the table to keep the
+ *                load factor at or below 1/2
+ * @param r - session with peer and peerHash set
+ */
+static void demux_insert(rdt_t *r) {
+  if (2 * (demux_count + 1) > demux_size) {
+    rdt_t **old = demux_table;
+    size_t oldSize = demux_size;
+    size_t i;
+
+    demux_size = oldSize ? 2 * oldSize : 64;
+    demux_table = xmalloc(demux_size * sizeof(*demux_table));
+    memset(demux_table, 0, demux_size * sizeof(*demux_table));
+    for (i = 0; i < oldSize; i++)
+      if (old[i])
+        demux_place(old[i]);
+    free(old);
+  }
+  demux_place(r);
+  demux_count++;
+  r->demuxed = 1;
+}
+
+
+
+/**
+ * demux_remove - deletes a server session, shifting later members of
+ *                its probe run back so lookups need no tombstones
+ * @param r - session to delete
+ */
+static void demux_remove(rdt_t *r) {
+  size_t mask = demux_size - 1;
+  size_t i, j;
+
+  for (i = r->peerHash & mask; demux_table[i] != r; i = (i + 1) & mask)
+    ;
+  demux_table[i] = NULL;
+  for (j = (i + 1) & mask; demux_table[j]; j = (j + 1) & mask) {
+    size_t home = demux_table[j]->peerHash & mask;
+    //leave entries whose home bucket lies cyclically in (i, j]
+    if (((j - home) & mask) < ((j - i) & mask))
+      continue;
+    demux_table[i] = demux_table[j];
+    demux_table[j] = NULL;
+    i = j;
+  }
+  demux_count--;
+  r->demuxed = 0;
+}
 
 
 
@@ -69,6 +882,8 @@ rdt_t *rdt_list;
  */
 rdt_t *rdt_create(conn_t *c, const struct sockaddr_storage *ss, const struct config_common *cc) {
   rdt_t *r;
+  size_t slotLen;
+  int i;
 
   r = xmalloc (sizeof (*r));
   memset (r, 0, sizeof (*r));
@@ -81,7 +896,16 @@ rdt_t *rdt_create(conn_t *c, const struct sockaddr_storage *ss, const struct con
     }
   }
 
+  //no connections means no pending timers, so the wheel can be reset
+  if (!rdt_list)
+    twheel_init(&rdt_wheel);
+
   r->c = c;
+  if (ss) {
+    r->peer = *ss;
+    r->peerHash = addrhash(ss);
+    demux_insert(r);
+  }
   r->next = rdt_list;
   r->prev = &rdt_list;
   if (rdt_list)
@@ -89,16 +913,43 @@ rdt_t *rdt_create(conn_t *c, const struct sockaddr_storage *ss, const struct con
   rdt_list = r;
 
   // add additional initialization code here
-  r->sentSeqno = 1;
-  r->recvdSeqno = 0;
-  r->sentAckno = 0;
-  r->recvdAckno = 0;
-  r->dataTimestamp = NULL;
-  r->ackTimestamp = NULL;
-  r->lastDataPktSent = NULL;
-  r->lastDataPktRecvd = NULL;
-  r->lastAckPktSent = NULL;
-  r->overflowBuf = NULL;
+  r->window = cc->window;
+  r->timeout = cc->timeout;
+  r->trailer = cc->crc32c ? CRC_LEN : 0;
+  r->srtt = 0;
+  r->rttvar = 0;
+  r->rto = cc->timeout;
+  r->backoff = 0;
+  r->dupThresh = cc->dupthresh;
+  cong_init(&r->cong, cc->cong, cc->window);
+  //with mapped input, payloads are sent (and resent) straight from the
+  //mapping, so the slots only hold headers
+  r->inMap = conn_inmap(c, &r->inMapLeft);
+  slotLen = r->inMap ? MAP_SLOTLEN : sizeof(packet_t);
+  r->sendBuf = xmalloc(r->window * slotLen);
+  r->sendRing = xmalloc(r->window * sizeof(*r->sendRing));
+  memset(r->sendRing, 0, r->window * sizeof(*r->sendRing));
+  for (i = 0; i < r->window; i++) {
+    r->sendRing[i].pkt = (packet_t *) (r->sendBuf + i * slotLen);
+    r->sendRing[i].r = r;
+    r->sendRing[i].timer.fn = rexmit_timeout;
+    r->sendRing[i].timer.arg = &r->sendRing[i];
+  }
+  r->tlpTimer.fn = tlp_timeout;
+  r->tlpTimer.arg = r;
+  r->ackTimer.fn = ack_timeout;
+  r->ackTimer.arg = r;
+  r->closeTimer.fn = close_timeout;
+  r->closeTimer.arg = r;
+  r->sendBase = 1;
+  r->nextSeqno = 1;
+  r->readEof = 0;
+  r->recvRing = xmalloc(r->window * sizeof(*r->recvRing));
+  r->recvMap = xmalloc((r->window + 63) / 64 * sizeof(*r->recvMap));
+  memset(r->recvMap, 0, (r->window + 63) / 64 * sizeof(*r->recvMap));
+  r->recvNext = 1;
+  r->recvHigh = 1;
+  r->recvEof = 0;
   return r;
 }
 
@@ -114,12 +965,58 @@ void rdt_destroy(rdt_t *r) {
   *r->prev = r->next;
   conn_destroy (r->c);
   // free any other allocated memory here
-  free(r->overflowBuf);
+  if (r->demuxed)
+    demux_remove(r);
+  if (r->paced) {
+    rdt_t **rp = &pace_list;
+    while (*rp != r)
+      rp = &(*rp)->paceNext;
+    *rp = r->paceNext;
+  }
+  for (; r->sendBase != r->nextSeqno; r->sendBase++)
+    timer_cancel(&rdt_wheel, &r->sendRing[r->sendBase % r->window].timer);
+  timer_cancel(&rdt_wheel, &r->tlpTimer);
+  timer_cancel(&rdt_wheel, &r->ackTimer);
+  timer_cancel(&rdt_wheel, &r->closeTimer);
+  free(r->sendRing);
+  free(r->sendBuf);
+  free(r->recvRing);
+  free(r->recvMap);
   free(r);
 }
 
 
 
+/**
+ * deliver - hands the contiguous run of buffered packets starting at
+ *           recvNext to the application layer
+ * @param r - reliable connection state information
+ * @returns # of packets delivered; stops early if conn_bufspace runs out
+ */
+static int deliver(rdt_t *r) {
+  int delivered = 0;
+
+  while (!r->recvEof && recv_test(r, r->recvNext)) {
+    packet_t *pkt = &r->recvRing[r->recvNext % r->window];
+    size_t n = pkt->len - DATA_HDRLEN;
+
+    if (n == 0) {
+      conn_output(r->c, NULL, 0);
+      r->recvEof = 1;
+    }
+    else if (conn_bufspace(r->c) < n)
+      break;
+    else
+      conn_output(r->c, pkt->data, n);
+    recv_clear(r, r->recvNext);
+    r->recvNext++;
+    delivered++;
+  }
+  return delivered;
+}
+
+
+
 /**
  * rdt_recvpkt - receive a packet from the unreliable network layer
  * @param r - reliable connection state information
@@ -127,86 +1024,66 @@ void rdt_destroy(rdt_t *r) {
  * @param n - size of received data in the packet
  */
 void rdt_recvpkt(rdt_t *r, packet_t *pkt, size_t n) {
-  uint16_t retCsumValue;
-  ntohs(pkt->len);
-  ntohl(pkt->ackno);
-
-  //if ack packet
-  if (pkt->len == 8){
-    fprintf(stderr, "receiving ack");
-    //check if ack packet corrupted
-    retCsumValue = cksum(pkt, n);
-    if (retCsumValue != pkt->cksum){
-      conn_sendpkt(r->c, lastDataPktSent, lastDataPktSent->len);
-      clock_gettime(CLOCK_MONOTONIC, r->dataTimestamp); 
-      fprintf(stderr, "resending due to corrupt ack packet");
-    }
-    //if acknowledging earlier seqno
-    //never recv curr dataPacket
-    if (pkt->ackno < r->sentSeqno){
-      conn_sendpkt(r->c, lastDataPktSent, lastDataPktSent->len);
-      clock_gettime(CLOCK_MONOTONIC, r->dataTimestamp);
-      fprintf(stderr, "resending due to earlier ack packet");
-    }
-    else{
-      r->recvdAckno = pkt->ackno;
-    }
+  size_t len;
+  uint32_t ackno;
+  uint32_t seqno;
+  int newAck, inOrder = 0;
+
+  //drop truncated, malformed and corrupted packets
+  if (!(len = pkt_len(pkt, n, r->trailer)))
+    return;
+  seqno = len == ACK_HDRLEN ? 0 : ntohl(pkt->seqno);
+  pkt->len = len;
+
+  //every packet carries a cumulative ackno; release acknowledged slots
+  ackno = ntohl(pkt->ackno);
+  newAck = recv_ack(r, ackno);
+  if (newAck)
+    rdt_done(r);
+
+  //ack-only packets repeating the ackno are dup acks; data packets
+  //repeat it whenever we have nothing new to acknowledge, so they don't
+  //count.  SACK blocks go first, so that a sacked hole is not resent.
+  if (seqno == 0) {
+    if (len != ACK_HDRLEN)
+      recv_sack(r, (struct sack_packet *) pkt);
+    if (!newAck)
+      recv_dupack(r, ackno);
+    else if (!r->readEof)
+      rdt_read(r);
+    return;
   }
-  //data packet
-  else{
-    fprintf(stderr, "received a data packet");
-    ntohl(pkt->seqno);
-    ntohl(pkt->data);
-    //corrupted packet, resend previous ack
-    retCsumValue = cksum(pkt, n);
-    if (retCsumValue != pkt->cksum){
-      //if not the first packet sent, resend last AckPacket
-      if (lastAckPktSent != NULL){
-        conn_sendpkt(r->c, lastAckPktSent, lastAckPktSent->len);
-        clock_gettime(CLOCK_MONOTONIC, r->ackTimestamp);
-        fprintf(stderr, "corrupt data packet, resending last ack sent");
-      }
-    }
-    //receiving duplicate packet
-    if (pkt->seqno < r->RecvdSeqno){
-      if (lastAckPktSent != NULL) {
-        conn_sendpkt(r->c, lastAckPktSent, lastAckPktSent->len);
-        clock_gettime(CLOCK_MONOTONIC, r->ackTimestamp);
-        fprintf(stderr, "duplicate data packet, resending last ack sent");
-      }
-    }
-    //correct seqno
-    else{
-      fprintf(stderr, "received a quality data packet");
-      lastDataPktRecvd = pkt;
-      r->recvdSeqno = pkt->seqno;
-      //attempt conn_bufspace
-      if (n < conn_bufspace(r->c)){
-        fprintf(stderr, "enough bufspace to send ack in recv_packet()");
-        conn_output(r->c, pkt->data, n);
-        packet_t * newAck;
-        newAck->cksum = 0;
-        newAck->len = ACK_HDRLEN;
-        newAck->ackno = pkt->seqno;
-        newAck->cksum = cksum(newAck, 8);
-        htons(newAck->len);
-        htonl(newAck->ackno);
-        conn_sendpkt(r->c, newAck, newAck->len);
-        clock_gettime(CLOCK_MONOTONIC, r->ackTimestamp);
-        lastAckPktSent = newAck;
-        r->sentAckno = pkt->seqno;
-      }
-      else {
-        overflowBuf = pkt;
-        return;
-      }
-      //if EOF received, send connoutput 0 size and manually call rdt_destroy()
-      if (n == 0){
-        fprintf(stderr, "received EOF from network");
-        rdt_destroy(r);
-      }
-    }
+
+  //data packet: buffer anything inside the receive window, then deliver
+  //whatever contiguous run is now complete.  Duplicates and packets
+  //outside the window are simply re-acked.
+  if (!r->recvEof && seqno - r->recvNext < (uint32_t) r->window
+      && !recv_test(r, seqno)) {
+    inOrder = seqno == r->recvNext && r->recvHigh == r->recvNext;
+    memcpy(&r->recvRing[seqno % r->window], pkt, len);
+    recv_set(r, seqno);
+    if ((int32_t) (seqno + 1 - r->recvHigh) > 0)
+      r->recvHigh = seqno + 1;
+    deliver(r);
   }
+
+  //the ack for an in-order packet may wait for the next one, or ride on
+  //the data sent below; anything else (a gap, a hole filled, a
+  //duplicate, output backing up, the EOF) is acked at once.  With a
+  //window of 1 there is never a next packet to wait for.
+  if (inOrder && r->recvNext == r->recvHigh && !r->recvEof
+      && r->window >= ACK_EVERY)
+    delay_ack(r);
+  else
+    send_ack(r);
+
+  //new data goes out only now, to carry the ackno just advanced; if
+  //there is none, every ACK_EVERY-th packet still gets its ack
+  if (newAck && !r->readEof)
+    rdt_read(r);
+  if (r->ackPending >= ACK_EVERY)
+    send_ack(r);
+  rdt_done(r);
 }
 
 
@@ -216,61 +1093,59 @@ void rdt_recvpkt(rdt_t *r, packet_t *pkt, size_t n) {
  * @param r - reliable connection state information
  */
 void rdt_read(rdt_t *r) {
-  char buf[500];
-  int n = sizeof(buf);
-  int dataRecvd = conn_input(r->c, buf, n);
-  fprintf(stderr, "received input from app. layer");
-  if(dataRecvd > 0){
-    //create a data packet and send to other process
-    packet_t * newDataPkt;
-    newDataPkt->cksum = 0;
-    newDataPkt->length = DATA_HDRLEN + n;
-    newDataPkt->ackno = r->sentAckno;
-    newDataPkt->seqno = r->sentSeqno;
-    newDataPkt->data = buf;
-    newDataPkt->cksum = cksum(newDataPkt, Data_HDRLEN + n);
-    //change to network byte order
-    htons(newDataPkt->cksum);
-    htons(newDataPkt->len);
-    htonl(newDataPkt->ackno);
-    htonl(newDataPkt->seqno);
-    htonl(newDataPkt->data);
-    conn_sendpkt(r->c, newDataPkt, newDataPkt->len);
-    clock_gettime(CLOCK_MONOTONIC, r->dataTimestamp);
-    fprintf(stderr, "sent data packet read in from app. layer");
-    lastDataPktSent = newDataPkt;
-    r->sentSeqno = r->sentSeqno + 1;
-    free(buf);
-  }
-  else if(dataRecvd == -1){
-    //conn_input returns -1: send over EOF to process and call rdt_destroy
-    fprintf(stderr, "recieved EOF from app. layer");
-    packet_t * newEOFPkt;
-    newDataPkt->cksum = 0;
-    newDataPkt->length = DATA_HDRLEN;
-    newDataPkt->ackno = r->sentAckno;
-    newDataPkt->seqno = r->sentSeqno;
-    newDataPkt->data = buf;
-    newDataPkt->cksum = cksum(newDataPkt, Data_HDRLEN);
-    //change to network byte order
-    htons(newDataPkt->cksum);
-    htons(newDataPkt->len);
-    htonl(newDataPkt->ackno);
-    htonl(newDataPkt->seqno);
-    htonl(newDataPkt->data);
-    conn_sendpkt(r->c, newDataPkt, newDataPkt->len);
-    clock_gettime(CLOCK_MONOTONIC, r->dataTimestamp);
-    fprintf(stderr, "send EOF from app. layer to network layer");
-    lastDataPktSent = newDataPkt;
-    r->sentSeqno = r->sentSeqno + 1;
-    free(buf);
-    // call rdt_destroy since we received an EOF 
-    rdt_destroy(r);
-  }
-  //0 bytes returned, nothing currently available
-  else{
-    return;
+  uint32_t first = r->nextSeqno;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  //keep filling the window, as far as congestion control allows, until
+  //it is full or input runs dry
+  while (!r->readEof
+         && r->nextSeqno - r->sendBase < (uint32_t) cong_window(&r->cong)) {
+    struct sendSlot *s = &r->sendRing[r->nextSeqno % r->window];
+    size_t max = sizeof(s->pkt->data) - r->trailer;
+    int n;
+
+    //too soon for the pacer: wait for rdt_pace
+    if (cong_pacing(&r->cong) > 0
+        && (int64_t) (r->paceAt - ts_us(&now)) > PACE_QUANTUM) {
+      if (!r->paced) {
+        r->paceNext = pace_list;
+        pace_list = r;
+        r->paced = 1;
+      }
+      break;
+    }
+
+    if (r->inMap) {
+      //the next slice of the mapping; an empty one is the EOF packet
+      n = r->inMapLeft < max ? r->inMapLeft : max;
+      s->mapped = r->inMap;
+      r->inMap += n;
+      r->inMapLeft -= n;
+      if (n == 0)
+        r->readEof = 1;
+    }
+    else if ((n = conn_input(r->c, s->pkt->data, max)) == 0)
+      break;
+    else if (n < 0) {
+      //EOF from the application: send a zero-length data packet
+      n = 0;
+      r->readEof = 1;
+    }
+    s->pkt->len = htons(DATA_HDRLEN + n);
+    s->pkt->ackno = htonl(r->recvNext);
+    s->pkt->seqno = htonl(r->nextSeqno);
+    s->len = pkt_seal(r, s->pkt, s->mapped, DATA_HDRLEN + n);
+    s->sacked = 0;
+    s->counted = 0;
+    s->retransmitted = 0;
+    send_slot(r, s, &now);
+    r->nextSeqno++;
   }
+
+  //the probe goes out 2 * SRTT after the newest packet
+  if (r->nextSeqno != first)
+    tlp_arm(r, &now);
 }
 
 
@@ -280,50 +1155,99 @@ void rdt_read(rdt_t *r) {
  * @param r - reliable connection state information
  */
 void rdt_output(rdt_t *r) {
-  fprintf(stderr, "space in buffer released, checking in output()");
-  if (overFlowBuf->len - ACK_HDRLEN < conn_bufspace(r->c)){
-    conn_output(r->c, overFlowBuf->data, overFlowBuf->len);
-    packet_t * newAck;
-    newAck->cksum = 0;
-    newAck->len = ACK_HDRLEN;
-    newAck->ackno = overFlowBuf->seqno;
-    newAck->cksum = cksum(newAck, 8);
-    htons(newAck->len);
-    htonl(newAck->ackno);
-    conn_sendpkt(r->c, newAck, newAck->len);
-    fprintf(stderr, "sent ack packet from outpu()");
-    clock_gettime(CLOCK_MONOTONIC, r->ackTimestamp);
-    lastAckPktSent = newAck;
-    r->sentAckno = pkt->seqno;
-  }
-  else{
+  if (!deliver(r))
     return;
-  }
+  send_ack(r);
+  rdt_done(r);
 }
 
 
 
 
 /**
- * rdt_timer() - timer callback invoked 1/5 of the retransmission rate
+ * rdt_timer() - timer callback invoked once rdt_timeout()'s deadline passes
  */
 void rdt_timer() {
-  struct timespec * now;
-  clock_gettime(CLOCK_MONOTONIC, now);
-  for (rdt * p = rdtlist; p; p = p->next){
-    if((now->tv_sec * 1000 - p->ackTimestamp->tv_sec * 1000) > cc->timeout){
-      conn_sendpkt(p->c, lastAckPktSent, lastAckPktSent->len);
-      clock_gettime(CLOCK_MONOTONIC, r->ackTimestamp);
-    }
-    if((now->tv_sec * 1000 - p->dataTimestamp->tv_sec * 1000) > cc->timetou){
-      conn_sendpkt(p->c, lastDataPktSent, lastDataPktSent->len);
-      clock_gettime(CLOCK_MONOTONIC, r->dataTimestamp);
+  //only buckets whose deadlines have passed are touched
+  twheel_run(&rdt_wheel, clock_ms());
+}
+
+
+
+/**
+ * rdt_timeout() - tells the event loop how long it may sleep
+ * @returns ms until the next retransmission deadline, -1 if none pending
+ *
+ * Data in flight, our EOF included, always has its oldest packet's RTO
+ * pending, and a finished session its linger timer.  The wheel is only
+ * empty when every session is idle, so checking that costs nothing on
+ * a busy server, and an RTO gone missing is re-armed rather than left
+ * to stall the session for good.
+ */
+long rdt_timeout() {
+  long next = twheel_next(&rdt_wheel);
+  rdt_t *r;
+
+  if (next >= 0)
+    return next;
+  for (r = rdt_list; r; r = r->next) {
+    struct sendSlot *s = &r->sendRing[r->sendBase % r->window];
+    if (r->sendBase != r->nextSeqno)
+      timer_set(&rdt_wheel, &s->timer, current_rto(r));
+  }
+  return twheel_next(&rdt_wheel);
+}
+
+
+
+/**
+ * rdt_pace() - lets every session whose pacing delay is over send again
+ */
+void rdt_pace() {
+  uint64_t now = clock_us();
+  rdt_t **rp = &pace_list, *r;
+
+  //rdt_read may put r straight back at the head, not yet due
+  while ((r = *rp)) {
+    if ((int64_t) (r->paceAt - now) > PACE_QUANTUM) {
+      rp = &r->paceNext;
+      continue;
     }
+    *rp = r->paceNext;
+    r->paced = 0;
+    rdt_read(r);
   }
 }
 
 
 
+/**
+ * rdt_pace_timeout() - tells the event loop when rdt_pace is next due
+ * @returns microseconds until then, -1 if no session is being paced
+ *
+ * Only sessions actually held back are on pace_list, so the scan is
+ * short even on a busy server.
+ */
+long rdt_pace_timeout() {
+  uint64_t now;
+  long next = -1;
+  rdt_t *r;
+
+  if (!pace_list)
+    return -1;
+  now = clock_us();
+  for (r = pace_list; r; r = r->paceNext) {
+    int64_t left = (int64_t) (r->paceAt - now) - PACE_QUANTUM;
+    if (left <= 0)
+      return 0;
+    if (next < 0 || left < next)
+      next = left;
+  }
+  return next;
+}
+
+
+
 /* This function only gets called when the process is running as a
  * server and must handle connections from multiple clients.  You have
  * to look up the rdt_t structure based on the address in the
@@ -333,5 +1257,14 @@ void rdt_timer() {
  * allocate a new connection.)
  */
 void rdt_demux(const struct config_common *cc, const struct sockaddr_storage *ss, packet_t *pkt, size_t len) {
-  // ignore this function
+  rdt_t *r = demux_find(ss, addrhash(ss));
+
+  if (!r) {
+    //only a valid data packet with seqno 1 opens a new session
+    if (pkt_len(pkt, len, cc->crc32c ? CRC_LEN : 0) < DATA_HDRLEN || ntohl(pkt->seqno) != 1)
+      return;
+    if (!(r = rdt_create(NULL, ss, cc)))
+      return;
+  }
+  rdt_recvpkt(r, pkt, len);
 }
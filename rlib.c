@@ -1,11 +1,15 @@
 /* rlib version 4 */
 
+#define _GNU_SOURCE             /* recvmmsg, sendmmsg */
+
 #include <assert.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -14,17 +18,68 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include "rlib.h"
 
+/* epoll(7) backend for conn_poll; build with -DHAVE_EPOLL=0 to leave
+ * only the portable poll() loop.  Either way, --poll selects poll() at
+ * run time. */
+#ifndef HAVE_EPOLL
+# ifdef __linux__
+#  define HAVE_EPOLL 1
+# else
+#  define HAVE_EPOLL 0
+# endif
+#endif
+#if HAVE_EPOLL
+# include <sys/epoll.h>
+# include <sys/syscall.h>
+#endif
+
+/* Optional io_uring engine (-u), driven through raw system calls so
+ * that no liburing is needed; -DHAVE_IO_URING=0 leaves it out. */
+#ifndef HAVE_IO_URING
+# if defined (__linux__) && defined (__has_include)
+#  if __has_include (<linux/io_uring.h>)
+#   define HAVE_IO_URING 1
+#  endif
+# endif
+#endif
+#ifndef HAVE_IO_URING
+# define HAVE_IO_URING 0
+#endif
+#if HAVE_IO_URING
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+#endif
+
 /*
  * local functions
  */
 static void conn_mkevents (void);
-static int debug_recv (int s, packet_t *buf, size_t len, int flags,
-    struct sockaddr_storage *from);
+static void conn_readable (conn_t *c);
+static void conn_neterr (const struct config_common *cc, conn_t *c);
+static void io_push (conn_t *c);
+static void io_wake (conn_t *c);
+#if HAVE_IO_URING
+static int uring_input (conn_t *c, void *buf, size_t n);
+static int uring_sendpkt (conn_t *c, const packet_t *pkt, size_t len,
+    size_t at, const void *ref, size_t reflen);
+static void uring_write (conn_t *c);
+static void uring_attach (conn_t *c);
+static void uring_detach (conn_t *c);
+#endif
+static int debug_recvmmsg (int s, packet_t *pkts, int *lens,
+    struct sockaddr_storage *from, int n);
+static int debug_recvgro (int s, packet_t *pkts, int *lens,
+    struct sockaddr_storage *from, int n);
 
 /*
  * local data structures
@@ -33,21 +88,147 @@ static int debug_recv (int s, packet_t *buf, size_t len, int flags,
 /* server side network layer info */
 struct config_server {
   struct config_common c;          // global config
-  int udp_socket;		               // receive UDP over this socket
   struct sockaddr_storage dest;	   // demultiplex traffic and relay to TCP connections at this address */
 };
 
 
-/* output buffers for receiver */
+#define RECV_BATCH 64             // packets per recvmmsg (or GRO burst)
+#define SEND_BATCH 64             // packets per sendmmsg
+#define GSO_SEGS 64               // packets the kernel segments per send
+
+/* datagrams conn_sendpkt has queued during this pass of conn_poll */
+struct sendq {
+  int fd;                         // socket they all go out on
+  int n;
+  packet_t pkt[SEND_BATCH];
+  size_t len[SEND_BATCH];                   // on the wire, with ref
+  const void *ref[SEND_BATCH];              // conn_sendref data, not copied
+  size_t refat[SEND_BATCH];                 // ... spliced in at this offset
+  size_t reflen[SEND_BATCH];
+  struct sockaddr_storage to[SEND_BATCH];   // server only
+  socklen_t tolen[SEND_BATCH];              // 0 on a connected socket
+};
+
+
+/* bytes of output per chunk; conn_output fills each one before
+ * starting the next */
+#define CHUNK_SIZE 4096
+
+/* output buffers for receiver, recycled through chunk_pool */
 struct chunk {
   struct chunk *next;
-  size_t size;
-  size_t used;
-  char buf[1];
+  size_t size;                     // bytes filled in
+  size_t used;                     // bytes already written out
+  char buf[CHUNK_SIZE];
 };
 typedef struct chunk chunk_t;
 
 
+#define RING_SLOTS 64             // chunks per SPSC ring, a power of two
+#define CACHE_LINE 64
+
+/* lock-free single-producer single-consumer queue of chunks; each index
+ * is written by one thread only and has a cache line of its own, so the
+ * two threads do not keep stealing it from each other */
+struct ring {
+  unsigned head __attribute__ ((aligned (CACHE_LINE)));  // next to take
+  unsigned tail __attribute__ ((aligned (CACHE_LINE)));  // next to fill
+  chunk_t *slot[RING_SLOTS] __attribute__ ((aligned (CACHE_LINE)));
+};
+
+/* -i: a thread doing a client's rfd and wfd I/O, so that a slow reader
+ * or writer never holds up packets and acks.  Chunks go back and forth
+ * between it and the network thread over the rings; a chunk of size 0
+ * is an EOF. */
+struct iothread {
+  struct ring in;                 // input read from rfd
+  struct ring infree;             // ... handed back once consumed
+  struct ring out;                // output for wfd
+  struct ring outfree;            // ... handed back once written
+  pthread_t thread;
+  int rfd;                        // the application's descriptors
+  int wfd;
+  int wake;                       // eventfd the I/O thread polls
+  int netwake;                    // eventfd the network thread polls
+  int sleeping;                   // I/O thread is in (or going into) poll
+  int stop;                       // conn_free: finish output and exit
+  int werr;                       // writing wfd failed
+  chunk_t *inch;                  // network side: input being consumed
+  int outflight;                  // network side: chunks not back yet
+  char eofsent;                   // network side: output EOF queued
+};
+
+
+#if HAVE_EPOLL
+/* a file descriptor registered with epoll; data.ptr points back here */
+struct evsrc {
+  conn_t *c;                      // owner, NULL for server socket/stderr
+  int fd;                         // -1 once unregistered
+  uint32_t want;                  // events we want reported
+  uint32_t have;                  // events registered with the kernel
+  char nopoll;                    // always ready: regular file or hung up
+  char dirty;                     // on ev_dirty until want reaches kernel
+  struct evsrc *nextdirty;
+  struct evsrc *nextnopoll;       // list of nopoll sources
+  struct evsrc **prevnopoll;
+};
+#endif
+
+
+#if HAVE_IO_URING
+#define UBUF_SIZE 2048            // bytes per registered buffer slot
+#define UBUF_SLOTS 256            // slots in the registered arena
+#define URING_SQ 256              // submission queue entries
+#define URING_CQ 4096             // completion queue entries
+#define URING_NETRECV 8           // receives kept posted per client socket
+#define URING_SRVRECV 32          // ... on the server's shared socket
+
+enum uop_kind {
+  UOP_NETRECV,                    // datagram on a client socket
+  UOP_SRVRECV,                    // datagram on the server socket
+  UOP_SEND,                       // datagram to a connection's peer
+  UOP_READ,                       // application input from rfd
+  UOP_WRITE,                      // application output to wfd
+  UOP_ERRWATCH,                   // error or hangup on stderr
+  UOP_CANCEL                      // cancellation of an orphaned op
+};
+
+/* one io_uring operation; its address is the SQE's user_data */
+struct uop {
+  conn_t *c;                      // owner, NULL for server/stderr/orphans
+  enum uop_kind kind;
+  char busy;                      // submitted, completion not yet seen
+  char polling;                   // waiting in POLL_ADD after -EAGAIN
+  int fd;
+  int slot;                       // registered buffer, -1 if buf malloc'd
+  char *buf;
+  size_t len;                     // bytes to transfer
+  int res;                        // result of the last completion
+  size_t off;                     // bytes of a completed read consumed
+  struct uop *target;             // UOP_CANCEL: op to cancel
+  struct msghdr msg;              // server RECVMSG/SENDMSG only
+  struct iovec iov;
+  struct sockaddr_storage addr;
+  struct uop *next;               // owner's list, or the free list
+  struct uop **prev;
+};
+
+/* the rings shared with the kernel, plus the registered buffers */
+struct uring {
+  int fd;
+  unsigned *sqhead, *sqtail, *sqarray, sqmask, sqentries;
+  unsigned *cqhead, *cqtail, cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  int fixed;                      // arena registered: use *_FIXED ops
+  char *arena;
+  int freeslot[UBUF_SLOTS];
+  int nfree;
+  struct uop *freeops;
+};
+#endif
+
+
 /* network layer connection state */
 struct conn {
   rdt_t *rel;			                // data from reliable layer
@@ -69,9 +250,58 @@ struct conn {
   char delete_me;		              // delete after draining
   chunk_t *outq;		              // chunks not yet written
   chunk_t **outqtail;
+  size_t outbytes;                // bytes in outq not yet written
+  const char *inmap;              // -m: rfd mapped in full, else NULL
+  size_t inmapsize;               // size of the mapping
+  size_t inmapoff;                // where rfd's file offset was
+  struct iothread *io;            // -i: rfd and wfd are its, both fds
+                                  // here are its netwake eventfd
+
+#if HAVE_EPOLL
+  struct evsrc rsrc;              // epoll registration for rfd
+  struct evsrc wsrc;              // ... for wfd, unless it is rfd
+  struct evsrc nsrc;              // ... for nfd, client only
+#endif
+#if HAVE_IO_URING
+  struct uop *uops;               // io_uring ops issued for c
+  struct uop *urd;                // read of rfd in flight or holding data
+  struct uop *uwr;                // write of wfd in flight
+#endif
 
   struct conn *next;		          // linked list of connections
   struct conn **prev;
+  struct conn *nextdead;          // conn_destroy()ed, awaiting conn_free
+};
+
+/* One event loop.  The server runs opt_workers of them, each on its own
+ * thread with its own SO_REUSEPORT socket, so the kernel spreads clients
+ * across them and they share nothing; the client runs just one. */
+struct worker {
+  int id;
+  pthread_t thread;
+  int udp_socket;                 // server's share of the port
+  int cevents_generation;         // bumped when cevents must be rebuilt
+  int last_cg;                    // generation cevents was built for
+  struct pollfd *cevents;
+  int ncevents;
+  conn_t **evreaders;
+  conn_t **evwriters;
+  conn_t *conn_list;
+  conn_t *conn_dead;
+  struct sendq sendq;
+  char nogso;                     // the kernel refused our UDP GSO sends
+  chunk_t *chunk_pool;            // free output chunks
+  char *grobuf;                   // debug_recvgro's receive buffer
+#if HAVE_EPOLL
+  int epoll_fd;                   // -1 when using poll()
+  struct evsrc server_src;
+  struct evsrc stderr_src;
+  struct evsrc *ev_dirty;
+  struct evsrc *ev_nopoll;
+#endif
+#if HAVE_IO_URING
+  struct uring *uring;            // NULL unless -u works
+#endif
 };
 
 /*
@@ -80,16 +310,18 @@ struct conn {
 
 char                        *progname;
 int                          opt_debug;
+int                          opt_poll;          // use poll() even if epoll works
+int                          opt_uring;         // use io_uring if it works
+int                          opt_gso;           // UDP GSO sends, GRO receives
+size_t                       opt_outbuf = 8192; // conn_output queue budget
+int                          opt_mmap;          // map regular input files
+int                          opt_workers = 1;   // server event loops (-n)
+int                          opt_iothread;      // rfd/wfd I/O on a thread
 int                          log_in = -1;
 int                          log_out = -1;
 static struct config_server *serverconf;
-int                          cevents_generation;
-static struct pollfd        *cevents;
-static int                   ncevents;
-static conn_t              **evreaders;
-static conn_t              **evwriters;
-static conn_t               *conn_list;
-struct timespec              last_timeout;
+static struct worker        *workers;
+static __thread struct worker *wk;              // this thread's event loop
 
 
 /**
@@ -145,7 +377,7 @@ void print_pkt (const packet_t *buf, const char *op, int n) {
     if (errno != EAGAIN)
       fprintf (stderr, "%5d %s(%3d): %s\n", pid, op, n, strerror (errno));
   }
-  else if (n == 8)
+  else if (n >= 8 && ntohs (buf->len) == 8)
     fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x\n",
         pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno));
   else if (n >= 12)
@@ -160,24 +392,153 @@ void print_pkt (const packet_t *buf, const char *op, int n) {
 
 
 
+/**
+ * sendq_flush() - sends every queued datagram with sendmmsg
+ *
+ * With -g, each run of equal-sized packets to one peer (the last may
+ * be shorter) goes down as a single buffer that the kernel splits into
+ * datagrams itself (UDP_SEGMENT).  If the kernel turns that down, GSO
+ * is switched off and the packets are sent one datagram each.
+ *
+ * A datagram the kernel refuses is dropped, as a lossy network would;
+ * if the socket buffer is full, so is the rest of the queue.
+ */
+static void sendq_flush (void) {
+  struct mmsghdr msg[SEND_BATCH];
+  struct iovec iov[3 * SEND_BATCH];
+  int iovat[SEND_BATCH + 1];      // packet i is iov[iovat[i] .. iovat[i+1]]
+  union {
+    char buf[CMSG_SPACE (sizeof (uint16_t))];
+    struct cmsghdr align;
+  } ctl[SEND_BATCH];
+  int first[SEND_BATCH];
+  int i, j, m, nmsg, r;
+  int p = 0;
+
+  for (i = 0, j = 0; i < wk->sendq.n; i++) {
+    size_t at = wk->sendq.ref[i] ? wk->sendq.refat[i] : wk->sendq.len[i];
+    char *pkt = (char *) &wk->sendq.pkt[i];
+    iovat[i] = j;
+    iov[j].iov_base = pkt;
+    iov[j++].iov_len = at;
+    if (wk->sendq.ref[i]) {
+      iov[j].iov_base = (void *) wk->sendq.ref[i];
+      iov[j++].iov_len = wk->sendq.reflen[i];
+      if (wk->sendq.len[i] > at + wk->sendq.reflen[i]) {
+        iov[j].iov_base = pkt + at;
+        iov[j++].iov_len = wk->sendq.len[i] - at - wk->sendq.reflen[i];
+      }
+    }
+  }
+  iovat[i] = j;
+
+  while (p < wk->sendq.n) {
+    /* one message per packet, or per run the kernel will segment */
+    for (nmsg = 0, i = p; i < wk->sendq.n; nmsg++, i = j) {
+      struct msghdr *h = &msg[nmsg].msg_hdr;
+      for (j = i + 1; opt_gso && !wk->nogso
+          && j < wk->sendq.n && j - i < GSO_SEGS
+          && wk->sendq.len[j - 1] == wk->sendq.len[i]
+          && wk->sendq.len[j] <= wk->sendq.len[i]
+          && wk->sendq.tolen[j] == wk->sendq.tolen[i]
+          && !memcmp (&wk->sendq.to[j], &wk->sendq.to[i], wk->sendq.tolen[i]); j++)
+        ;
+      memset (h, 0, sizeof (*h));
+      h->msg_iov = &iov[iovat[i]];
+      h->msg_iovlen = iovat[j] - iovat[i];
+      if (wk->sendq.tolen[i]) {
+        h->msg_name = &wk->sendq.to[i];
+        h->msg_namelen = wk->sendq.tolen[i];
+      }
+      if (j - i > 1) {
+        struct cmsghdr *cm;
+        uint16_t seg = wk->sendq.len[i];
+        h->msg_control = ctl[nmsg].buf;
+        h->msg_controllen = sizeof (ctl[nmsg].buf);
+        cm = CMSG_FIRSTHDR (h);
+        cm->cmsg_level = IPPROTO_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN (sizeof (seg));
+        memcpy (CMSG_DATA (cm), &seg, sizeof (seg));
+      }
+      first[nmsg] = i;
+    }
+
+    for (m = 0; m < nmsg; m += r) {
+      r = sendmmsg (wk->sendq.fd, msg + m, nmsg - m, 0);
+      if (r >= 0)
+        continue;
+      if (msg[m].msg_hdr.msg_controllen
+          && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+        fprintf (stderr, "[UDP GSO unavailable: %s]\n", strerror (errno));
+        wk->nogso = 1;
+        break;
+      }
+      if (opt_debug)
+        print_pkt (&wk->sendq.pkt[first[m]], "send", -1);
+      if (errno == EAGAIN) {
+        m = nmsg;
+        break;
+      }
+      r = 1;
+    }
+    p = m < nmsg ? first[m] : wk->sendq.n;
+  }
+  wk->sendq.n = 0;
+}
+
+
+
 /**
  * conn_sendpkt() - deliver a packet to the unreliable network layer
  * @param c - connection state information
  * @param pkt - packet to send
  * @param len - sizeof packet
- * @returns # of bytes written on success, -1 otherwise
+ * @returns # of bytes queued; like any datagram, the packet may be lost
+ *
+ * Packets are queued and go out together, in one sendmmsg, at the end
+ * of the current pass of conn_poll (see sendq_flush).
  */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len) {
-  int n;
-  assert (!c->delete_me);
+  return conn_sendref (c, pkt, len, len, NULL, 0);
+}
+
+
+
+/**
+ * conn_sendref() - conn_sendpkt with part of the packet left in place
+ * @param c - connection state information
+ * @param pkt - the rest of the packet, copied
+ * @param len - size of pkt
+ * @param at - offset in pkt where ref goes
+ * @param ref - data to splice in; it must stay unchanged until the
+ *              packet leaves, at the end of this pass of conn_poll
+ * @param reflen - size of ref
+ * @returns # of bytes queued
+ */
+int conn_sendref (conn_t *c, const packet_t *pkt, size_t len,
+    size_t at, const void *ref, size_t reflen) {
+  int i;
+  assert (!c->delete_me && len + reflen <= sizeof (packet_t) && at <= len);
+#if HAVE_IO_URING
+  if (wk->uring)
+    return uring_sendpkt (c, pkt, len, at, ref, reflen);
+#endif
+  if (wk->sendq.n == SEND_BATCH || (wk->sendq.n && wk->sendq.fd != c->nfd))
+    sendq_flush ();
+  i = wk->sendq.n++;
+  wk->sendq.fd = c->nfd;
+  memcpy (&wk->sendq.pkt[i], pkt, len);
+  wk->sendq.len[i] = len + reflen;
+  wk->sendq.ref[i] = reflen ? ref : NULL;
+  wk->sendq.refat[i] = at;
+  wk->sendq.reflen[i] = reflen;
+  wk->sendq.tolen[i] = c->server ? addrsize (&c->peer) : 0;
   if (c->server)
-    n = sendto (c->nfd, pkt, len, 0,
-        (const struct sockaddr *) &c->peer, addrsize (&c->peer));
-  else
-    n = send (c->nfd, pkt, len, 0);
+    wk->sendq.to[i] = c->peer;
   if (opt_debug)
-    print_pkt (pkt, "send", n);
-  return n;
+    print_pkt (pkt, "send", len + reflen);
+  return len + reflen;
 }
 
 
@@ -185,468 +546,2161 @@ int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len) {
 /**
  * conn_bufspace() - calculates remaining app layer buffer space
  * @param c - connection state information
- * @returns # bytes available in buffer
+ * @returns # bytes available in buffer, out of the -b budget
  */
 size_t conn_bufspace (conn_t *c) {
-  chunk_t *ch;
-  size_t used = 0;
-  const size_t bufsize = 8192;
-
-  for (ch = c->outq; ch; ch = ch->next)
-    used += (ch->size - ch->used);
-  return used > bufsize ? 0 : bufsize - used;
+  return c->outbytes > opt_outbuf ? 0 : opt_outbuf - c->outbytes;
 }
 
 
 
+#if HAVE_EPOLL
 /**
- * conn_output() - writes payload data to the application layer
- * @param c - connection state information
- * @param _buf - buffer to write
- * @param _n - size of buffer
- * @returns # of bytes written, 0 if buffer is full, -1 on error
+ * ev_nopoll_link() - treats a source as permanently ready
+ * @param src - source epoll cannot (or no longer needs to) watch
  */
-int conn_output (conn_t *c, const void *_buf, size_t _n) {
-  const char *buf = _buf;
-  int n = _n;
+static void ev_nopoll_link (struct evsrc *src) {
+  src->nopoll = 1;
+  src->nextnopoll = wk->ev_nopoll;
+  src->prevnopoll = &wk->ev_nopoll;
+  if (wk->ev_nopoll)
+    wk->ev_nopoll->prevnopoll = &src->nextnopoll;
+  wk->ev_nopoll = src;
+}
 
-  assert (!c->delete_me && !c->write_eof);
 
-  if (n == 0) {
-    c->write_eof = 1;
-    if (!c->outq)
-      shutdown (c->wfd, SHUT_WR);
-    return 0;
-  }
 
-  if (c->write_err) {
-    if (c->write_err == 2)
-      fprintf (stderr, "conn_output: attempt to write after error\n");
-    c->write_err = 2;
+/**
+ * ev_add() - registers a file descriptor with epoll
+ * @param src - registration to fill in
+ * @param c - owning connection, or NULL
+ * @param fd - file descriptor to watch
+ * @param want - EPOLLIN/EPOLLOUT events initially wanted
+ * @returns 0 on success, -1 with errno set on failure
+ */
+static int ev_add (struct evsrc *src, conn_t *c, int fd, uint32_t want) {
+  struct epoll_event ev;
+
+  memset (src, 0, sizeof (*src));
+  src->c = c;
+  src->fd = fd;
+  src->want = src->have = want;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = want;
+  ev.data.ptr = src;
+  if (epoll_ctl (wk->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+    return 0;
+  if (errno != EPERM) {
+    src->fd = -1;
     return -1;
   }
+  /* epoll refuses regular files and the like, which never block */
+  ev_nopoll_link (src);
+  return 0;
+}
 
-  if (!conn_bufspace (c))
-    return 0;
 
-  if (log_out >= 0)
-    write (log_out, buf, n);
 
-  if (!c->outq) {
-    int r = write (c->wfd, buf, n);
-    if (r < 0) {
-      if (errno != EAGAIN) {
-        perror ("write");
-        c->write_err = 2;
-        return -1;
-      }
-    }
-    else {
-      buf += r;
-      n -= r;
+/**
+ * ev_want() - turns interest in some events on or off
+ * @param src - registration to change
+ * @param bits - EPOLLIN and/or EPOLLOUT
+ * @param on - non-zero to want the events, zero to ignore them
+ *
+ * The kernel is only told in ev_flush(), so flipping interest back
+ * and forth within one loop iteration costs no system calls.
+ */
+static void ev_want (struct evsrc *src, uint32_t bits, int on) {
+  if (on)
+    src->want |= bits;
+  else
+    src->want &= ~bits;
+  if (src->fd < 0 || src->nopoll || src->dirty || src->want == src->have)
+    return;
+  src->dirty = 1;
+  src->nextdirty = wk->ev_dirty;
+  wk->ev_dirty = src;
+}
+
+
+
+/**
+ * ev_flush() - pushes changed interest sets to the kernel
+ */
+static void ev_flush (void) {
+  struct evsrc *src;
+  struct epoll_event ev;
+
+  while ((src = wk->ev_dirty)) {
+    wk->ev_dirty = src->nextdirty;
+    src->dirty = 0;
+    if (src->fd < 0 || src->nopoll || src->want == src->have)
+      continue;
+    memset (&ev, 0, sizeof (ev));
+    ev.events = src->want;
+    ev.data.ptr = src;
+    if (epoll_ctl (wk->epoll_fd, EPOLL_CTL_MOD, src->fd, &ev) < 0) {
+      perror ("epoll_ctl");
+      exit (1);
     }
+    src->have = src->want;
   }
+}
 
-  if (n > 0) {
-    chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n]));
-    ch->next = NULL;
-    ch->size = n;
-    ch->used = 0;
-    memcpy (ch->buf, buf, n);
-    *c->outqtail = ch;
-    c->outqtail = &ch->next;
+
+
+/**
+ * ev_del() - unregisters a file descriptor before it is closed
+ * @param src - registration to remove; ev_flush() must have run
+ */
+static void ev_del (struct evsrc *src) {
+  if (src->fd < 0)
+    return;
+  if (src->nopoll) {
+    if (src->nextnopoll)
+      src->nextnopoll->prevnopoll = src->prevnopoll;
+    *src->prevnopoll = src->nextnopoll;
   }
+  else
+    epoll_ctl (wk->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+  src->fd = -1;
+}
 
-  if (c->wpoll && c->outq)
-    cevents[c->wpoll].events |= POLLOUT;
-  return _n;
+
+
+/**
+ * conn_wsrc() - finds the registration covering a connection's wfd
+ * @param c - connection state information
+ */
+static struct evsrc * conn_wsrc (conn_t *c) {
+  return c->wfd == c->rfd ? &c->rsrc : &c->wsrc;
 }
+#endif
 
 
 
 /**
- * conn_input() - reads data from application layer
+ * conn_want_read() - starts or stops watching rfd for input
  * @param c - connection state information
- * @param buf - buffer to read into
- * @param n - max size of buffer
- * @returns # of bytes read on success, 0 if no data available, -1 on error
+ * @param on - non-zero to watch, zero to stop
  */
-int conn_input (conn_t *c, void *buf, size_t n) {
-  int r;
-  assert (!c->delete_me);
+static void conn_want_read (conn_t *c, int on) {
+  /* netwake also says output was written, so it is always watched */
+  if (c->io)
+    return;
+#if HAVE_EPOLL
+  if (wk->epoll_fd >= 0) {
+    ev_want (&c->rsrc, EPOLLIN, on);
+    return;
+  }
+#endif
+#if HAVE_IO_URING
+  /* uring_input reads ahead whenever its buffer runs dry */
+  if (wk->uring)
+    return;
+#endif
+  if (!c->rpoll)
+    return;
+  if (on)
+    wk->cevents[c->rpoll].events |= POLLIN;
+  else
+    wk->cevents[c->rpoll].events &= ~POLLIN;
+}
 
-  if (c->read_eof)
-    return -1;
-  r = read (c->rfd, buf, n);
-  if (r == 0 || (r < 0 && errno != EAGAIN)) {
-    if (r == 0)
-      errno = EIO;
-    r = -1;
-    c->read_eof = 1;
-    return r;
+
+
+/**
+ * conn_want_write() - starts or stops watching wfd for buffer space
+ * @param c - connection state information
+ * @param on - non-zero to watch, zero to stop
+ */
+static void conn_want_write (conn_t *c, int on) {
+  /* the I/O thread does the waiting; hand it the queue */
+  if (c->io) {
+    if (on)
+      io_push (c);
+    return;
   }
-  if (r < 0 && errno == EAGAIN)
-    r = 0;
+#if HAVE_EPOLL
+  if (wk->epoll_fd >= 0) {
+    ev_want (conn_wsrc (c), EPOLLOUT, on);
+    return;
+  }
+#endif
+#if HAVE_IO_URING
+  /* completions, not readiness, drive io_uring: keep a write going */
+  if (wk->uring) {
+    if (on)
+      uring_write (c);
+    return;
+  }
+#endif
+  if (!c->wpoll)
+    return;
+  if (on)
+    wk->cevents[c->wpoll].events |= POLLOUT;
+  else
+    wk->cevents[c->wpoll].events &= ~POLLOUT;
+}
 
-  if (r > 0 && log_in >= 0)
-    write (log_in, buf, r);
 
-  c->xoff = 0;
-  cevents[c->rpoll].events |= POLLIN;
-  return r;
+
+/**
+ * chunk_alloc() - allocates a new chunk
+ * @returns the new chunk
+ */
+static chunk_t * chunk_alloc (void) {
+  return xmalloc (sizeof (chunk_t));
 }
 
 
 
 /**
- * conn_alloc() allocates/initializes connection state information
- * @returns pointer to new connection structure
+ * chunk_free() - releases a chunk
+ * @param ch - chunk, which must not be used again
  */
-static conn_t * conn_alloc (void) {
-  conn_t *c = xmalloc (sizeof (*c));
-  memset (c, 0, sizeof (*c));
-  c->prev = &conn_list;
-  c->next = conn_list;
-  c->outqtail = &c->outq;
-  if (conn_list)
-    conn_list->prev = &c->next;
-  conn_list = c;
+static void chunk_free (chunk_t *ch) {
+  free (ch);
+}
 
-  cevents_generation++;
 
-  return c;
+
+/**
+ * chunk_get() - takes an empty chunk from the pool, or a new one
+ * @returns the chunk
+ */
+static chunk_t * chunk_get (void) {
+  chunk_t *ch;
+
+  if ((ch = wk->chunk_pool))
+    wk->chunk_pool = ch->next;
+  else
+    ch = chunk_alloc ();
+  ch->next = NULL;
+  ch->size = 0;
+  ch->used = 0;
+  return ch;
 }
 
 
 
 /**
- * conn_create - create a new network layer connection
- * @param rel - reliable connection associated with this connection
- * @param ss - sockaddr structure if running as server
- * @returns pointer to new connection structure
+ * outq_append() - queues output that could not be written yet
+ * @param c - connection state information
+ * @param buf - data to queue
+ * @param n - size of data
+ *
+ * Tops up the last chunk in the queue before taking more from the pool,
+ * so the queue holds as few chunks as possible.
  */
-conn_t * conn_create (rdt_t *rel, const struct sockaddr_storage *ss) {
-  int n;
-  conn_t *c;
+static void outq_append (conn_t *c, const char *buf, size_t n) {
+  /* outqtail points at the last chunk's next field */
+  chunk_t *ch = c->outq ? (chunk_t *) ((char *) c->outqtail
+      - offsetof (chunk_t, next)) : NULL;
+
+  c->outbytes += n;
+  while (n > 0) {
+    size_t k;
+
+    if (!ch || ch->size == CHUNK_SIZE) {
+      ch = chunk_get ();
+      *c->outqtail = ch;
+      c->outqtail = &ch->next;
+    }
+    k = CHUNK_SIZE - ch->size < n ? CHUNK_SIZE - ch->size : n;
+    memcpy (ch->buf + ch->size, buf, k);
+    ch->size += k;
+    buf += k;
+    n -= k;
+  }
+}
+
+
+
+/**
+ * outq_consume() - retires output that has been written
+ * @param c - connection state information
+ * @param n - # of bytes written from the head of the queue
+ *
+ * Finished chunks go back to the pool.
+ */
+static void outq_consume (conn_t *c, size_t n) {
+  chunk_t *ch;
+
+  while (n > 0 && (ch = c->outq)) {
+    size_t k = ch->size - ch->used;
+    if (k > n)
+      k = n;
+    ch->used += k;
+    c->outbytes -= k;
+    n -= k;
+    if (ch->used < ch->size)
+      break;
+    c->outq = ch->next;
+    if (!c->outq)
+      c->outqtail = &c->outq;
+    ch->next = wk->chunk_pool;
+    wk->chunk_pool = ch;
+  }
+}
+
+
+
+/**
+ * ring_put() - adds a chunk to a ring, from the ring's one producer
+ * @param r - ring
+ * @param ch - chunk to add
+ * @returns 0 on success, -1 if the ring is full
+ */
+static int ring_put (struct ring *r, chunk_t *ch) {
+  unsigned tail = r->tail;
+
+  if (tail - __atomic_load_n (&r->head, __ATOMIC_ACQUIRE) == RING_SLOTS)
+    return -1;
+  r->slot[tail % RING_SLOTS] = ch;
+  __atomic_store_n (&r->tail, tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+
+/**
+ * ring_get() - takes the oldest chunk off a ring, from its one consumer
+ * @param r - ring
+ * @returns the chunk, NULL if the ring is empty
+ */
+static chunk_t * ring_get (struct ring *r) {
+  unsigned head = r->head;
+  chunk_t *ch;
+
+  if (head == __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  ch = r->slot[head % RING_SLOTS];
+  __atomic_store_n (&r->head, head + 1, __ATOMIC_RELEASE);
+  return ch;
+}
+
+
+
+/**
+ * ring_empty() - checks a ring for chunks, from its consumer
+ * @param r - ring
+ * @returns non-zero if ring_get would return NULL
+ */
+static int ring_empty (struct ring *r) {
+  return r->head == __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+}
+
+
+
+/**
+ * io_main() - the I/O thread: moves chunks between rfd/wfd and the rings
+ * @param arg - the connection's struct iothread
+ *
+ * Reads ahead into a fixed set of RING_SLOTS chunks, so neither of the
+ * input rings can overflow, and writes out the output ring in order.
+ * It sleeps in poll only after saying so in sleeping and looking at the
+ * rings once more, so io_kick never leaves a chunk unnoticed.
+ */
+static void *io_main (void *arg) {
+  struct iothread *io = arg;
+  chunk_t *avail = NULL, *cur = NULL, *ch;
+  int i, reof = 0;
+
+  for (i = 0; i < RING_SLOTS; i++) {
+    ch = chunk_alloc ();
+    ch->next = avail;
+    avail = ch;
+  }
+
+  for (;;) {
+    struct pollfd pfd[3];
+    eventfd_t v;
+    int n = 0, pushed = 0;
+
+    while ((ch = ring_get (&io->infree))) {
+      ch->next = avail;
+      avail = ch;
+    }
+
+    /* EOF or an error ends the input with an empty chunk */
+    while (!reof && avail) {
+      ssize_t r = read (io->rfd, avail->buf, CHUNK_SIZE);
+      if (r < 0 && errno == EAGAIN)
+        break;
+      ch = avail;
+      avail = ch->next;
+      ch->size = r > 0 ? r : 0;
+      ch->used = 0;
+      reof = r <= 0;
+      ring_put (&io->in, ch);
+      pushed = 1;
+    }
+
+    /* once writing fails, output is just handed back */
+    while (cur || (cur = ring_get (&io->out))) {
+      if (cur->size == 0)
+        shutdown (io->wfd, SHUT_WR);
+      else if (!io->werr) {
+        ssize_t r = write (io->wfd, cur->buf + cur->used,
+            cur->size - cur->used);
+        if (r < 0 && errno == EAGAIN)
+          break;
+        if (r < 0) {
+          perror ("write");
+          __atomic_store_n (&io->werr, 1, __ATOMIC_RELEASE);
+        }
+        else if ((cur->used += r) < cur->size)
+          continue;
+      }
+      ring_put (&io->outfree, cur);
+      cur = NULL;
+      pushed = 1;
+    }
+
+    if (pushed)
+      eventfd_write (io->netwake, 1);
+    if (!cur && __atomic_load_n (&io->stop, __ATOMIC_ACQUIRE)
+        && ring_empty (&io->out))
+      break;
+
+    __atomic_store_n (&io->sleeping, 1, __ATOMIC_SEQ_CST);
+    if ((!cur && (!ring_empty (&io->out)
+            || __atomic_load_n (&io->stop, __ATOMIC_SEQ_CST)))
+        || (!avail && !ring_empty (&io->infree))) {
+      __atomic_store_n (&io->sleeping, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    pfd[n].fd = io->wake;
+    pfd[n++].events = POLLIN;
+    if (!reof && avail) {
+      pfd[n].fd = io->rfd;
+      pfd[n++].events = POLLIN;
+    }
+    if (cur) {
+      pfd[n].fd = io->wfd;
+      pfd[n++].events = POLLOUT;
+    }
+    poll (pfd, n, -1);
+    __atomic_store_n (&io->sleeping, 0, __ATOMIC_RELAXED);
+    if (pfd[0].revents & POLLIN)
+      eventfd_read (io->wake, &v);
+  }
+
+  while ((ch = avail)) {
+    avail = ch->next;
+    chunk_free (ch);
+  }
+  return NULL;
+}
+
+
+
+/**
+ * io_kick() - wakes the I/O thread if it is asleep
+ * @param io - the connection's I/O thread
+ */
+static void io_kick (struct iothread *io) {
+  if (__atomic_exchange_n (&io->sleeping, 0, __ATOMIC_SEQ_CST))
+    eventfd_write (io->wake, 1);
+}
+
+
+
+/**
+ * io_start() - gives a connection's rfd and wfd to an I/O thread (-i)
+ * @param c - connection state information
+ *
+ * From then on c->rfd and c->wfd are both the thread's netwake, which
+ * the event loop watches in their place.
+ */
+static void io_start (conn_t *c) {
+  struct iothread *io;
+
+  if ((errno = posix_memalign ((void **) &io, CACHE_LINE, sizeof (*io)))) {
+    perror ("posix_memalign");
+    abort ();
+  }
+  memset (io, 0, sizeof (*io));
+  io->rfd = c->rfd;
+  io->wfd = c->wfd;
+  if ((io->wake = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0
+      || (io->netwake = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0) {
+    perror ("eventfd");
+    exit (1);
+  }
+  c->rfd = c->wfd = io->netwake;
+  c->io = io;
+  if ((errno = pthread_create (&io->thread, NULL, io_main, io))) {
+    perror ("pthread_create");
+    exit (1);
+  }
+}
+
+
+
+/**
+ * io_stop() - lets the I/O thread finish its output, then reaps it
+ * @param c - connection state information
+ *
+ * Gives c back its own rfd and wfd, for conn_free to close.
+ */
+static void io_stop (conn_t *c) {
+  struct iothread *io = c->io;
+  chunk_t *ch;
+
+  __atomic_store_n (&io->stop, 1, __ATOMIC_SEQ_CST);
+  eventfd_write (io->wake, 1);
+  pthread_join (io->thread, NULL);
+
+  while ((ch = ring_get (&io->outfree))) {
+    ch->next = wk->chunk_pool;
+    wk->chunk_pool = ch;
+  }
+  if (io->inch)
+    chunk_free (io->inch);
+  while ((ch = ring_get (&io->in)))
+    chunk_free (ch);
+  while ((ch = ring_get (&io->infree)))
+    chunk_free (ch);
+  close (io->wake);
+  close (io->netwake);
+  c->rfd = io->rfd;
+  c->wfd = io->wfd;
+  c->io = NULL;
+  free (io);
+}
+
+
+
+/**
+ * io_input() - takes input the I/O thread has read, for conn_input
+ * @param c - connection state information
+ * @param buf - buffer to read into
+ * @param n - max size of buffer
+ * @returns as read(2) would
+ */
+static int io_input (conn_t *c, void *buf, size_t n) {
+  struct iothread *io = c->io;
+  chunk_t *ch = io->inch;
+
+  if (!ch && !(ch = io->inch = ring_get (&io->in))) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (n > ch->size - ch->used)
+    n = ch->size - ch->used;
+  memcpy (buf, ch->buf + ch->used, n);
+  ch->used += n;
+  /* the EOF chunk is kept, so every later call sees it too */
+  if (ch->size && ch->used == ch->size) {
+    io->inch = NULL;
+    ring_put (&io->infree, ch);
+    io_kick (io);
+  }
+  return n;
+}
+
+
+
+/**
+ * io_push() - hands the output queue on to the I/O thread
+ * @param c - connection state information
+ *
+ * Chunks count against conn_bufspace until io_wake gets them back.
+ * Only RING_SLOTS are out at a time, so outfree always has room.
+ */
+static void io_push (conn_t *c) {
+  struct iothread *io = c->io;
+  chunk_t *ch;
+  int pushed = 0;
+
+  while (io->outflight < RING_SLOTS) {
+    if ((ch = c->outq)) {
+      c->outq = ch->next;
+      if (!c->outq)
+        c->outqtail = &c->outq;
+    }
+    else if (c->write_eof && !io->eofsent) {
+      ch = chunk_get ();
+      io->eofsent = 1;
+    }
+    else
+      break;
+    ring_put (&io->out, ch);
+    io->outflight++;
+    pushed = 1;
+  }
+  if (pushed)
+    io_kick (io);
+}
+
+
+
+/**
+ * io_wake() - services netwake, in place of conn_readable
+ * @param c - connection state information
+ *
+ * The I/O thread signals netwake after queueing input or handing back
+ * output.  The eventfd is cleared before the rings are looked at, so
+ * nothing the thread adds later can go unnoticed.
+ */
+static void io_wake (conn_t *c) {
+  struct iothread *io = c->io;
+  chunk_t *ch;
+  eventfd_t v;
+  int written = 0;
+
+  eventfd_read (io->netwake, &v);
+  while ((ch = ring_get (&io->outfree))) {
+    c->outbytes -= ch->size;
+    io->outflight--;
+    ch->next = wk->chunk_pool;
+    wk->chunk_pool = ch;
+    written = 1;
+  }
+  if (__atomic_load_n (&io->werr, __ATOMIC_ACQUIRE) && !c->write_err)
+    c->write_err = 1;
+  io_push (c);
+
+  /* as conn_readable, reading stays paused until conn_input is called */
+  if (!c->xoff) {
+    c->xoff = 1;
+    rdt_read (c->rel);
+  }
+  if (written && !c->delete_me)
+    rdt_output (c->rel);
+}
+
+
+
+/**
+ * conn_output() - writes payload data to the application layer
+ * @param c - connection state information
+ * @param _buf - buffer to write
+ * @param _n - size of buffer
+ * @returns # of bytes written, 0 if buffer is full, -1 on error
+ */
+int conn_output (conn_t *c, const void *_buf, size_t _n) {
+  const char *buf = _buf;
+  int n = _n;
+
+  assert (!c->delete_me && !c->write_eof);
+
+  if (n == 0) {
+    c->write_eof = 1;
+    if (c->io)
+      io_push (c);
+    else if (!c->outq)
+      shutdown (c->wfd, SHUT_WR);
+    return 0;
+  }
+
+  if (c->write_err) {
+    if (c->write_err == 2)
+      fprintf (stderr, "conn_output: attempt to write after error\n");
+    c->write_err = 2;
+    return -1;
+  }
+
+  if (!conn_bufspace (c))
+    return 0;
+
+  if (log_out >= 0)
+    write (log_out, buf, n);
+
+  /* io_uring output all goes through the queue, see uring_write, and
+   * so does output written by the I/O thread, see io_push */
+  if (!c->outq && !opt_uring && !c->io) {
+    int r = write (c->wfd, buf, n);
+    if (r < 0) {
+      if (errno != EAGAIN) {
+        perror ("write");
+        c->write_err = 2;
+        return -1;
+      }
+    }
+    else {
+      buf += r;
+      n -= r;
+    }
+  }
+
+  if (n > 0)
+    outq_append (c, buf, n);
+
+  if (c->outq)
+    conn_want_write (c, 1);
+  return _n;
+}
+
+
+
+/**
+ * conn_inmap() - gives the input file as memory, in place of conn_input
+ * @param c - connection state information
+ * @param size - returns the # of bytes from there to the end of the file
+ * @returns the unread part of the input if -m mapped it, NULL otherwise
+ */
+const char * conn_inmap (conn_t *c, size_t *size) {
+  if (!c->inmap)
+    return NULL;
+  *size = c->inmapsize - c->inmapoff;
+  return c->inmap + c->inmapoff;
+}
+
+
+
+/**
+ * conn_input() - reads data from application layer
+ * @param c - connection state information
+ * @param buf - buffer to read into
+ * @param n - max size of buffer
+ * @returns # of bytes read on success, 0 if no data available, -1 on error
+ */
+int conn_input (conn_t *c, void *buf, size_t n) {
+  int r;
+  assert (!c->delete_me);
+
+  if (c->read_eof)
+    return -1;
+#if HAVE_IO_URING
+  if (wk->uring)
+    r = uring_input (c, buf, n);
+  else
+#endif
+  if (c->io)
+    r = io_input (c, buf, n);
+  else
+    r = read (c->rfd, buf, n);
+  if (r == 0 || (r < 0 && errno != EAGAIN)) {
+    if (r == 0)
+      errno = EIO;
+    r = -1;
+    c->read_eof = 1;
+    return r;
+  }
+  if (r < 0 && errno == EAGAIN)
+    r = 0;
+
+  if (r > 0 && log_in >= 0)
+    write (log_in, buf, r);
+
+  c->xoff = 0;
+  conn_want_read (c, 1);
+  return r;
+}
+
+
+
+/**
+ * conn_mapin() - maps rfd into memory if it is a regular file (-m)
+ * @param c - connection state information
+ */
+static void conn_mapin (conn_t *c) {
+  struct stat st;
+  off_t pos;
+  void *p;
+
+  if (fstat (c->rfd, &st) < 0 || !S_ISREG (st.st_mode)
+      || (pos = lseek (c->rfd, 0, SEEK_CUR)) < 0 || pos >= st.st_size)
+    return;
+  p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, c->rfd, 0);
+  if (p == MAP_FAILED) {
+    perror ("mmap");
+    return;
+  }
+  madvise (p, st.st_size, MADV_SEQUENTIAL);
+  c->inmap = p;
+  c->inmapsize = st.st_size;
+  c->inmapoff = pos;
+}
+
+
+
+/**
+ * conn_alloc() allocates/initializes connection state information
+ * @param rfd - input file descriptor
+ * @param wfd - output file descriptor, may equal rfd
+ * @param nfd - network file descriptor
+ * @param server - non-zero if nfd is the server's shared UDP socket
+ * @returns pointer to new connection structure
+ */
+static conn_t * conn_alloc (int rfd, int wfd, int nfd, int server) {
+  conn_t *c = xmalloc (sizeof (*c));
+  memset (c, 0, sizeof (*c));
+  c->rfd = rfd;
+  c->wfd = wfd;
+  c->nfd = nfd;
+  c->server = server;
+  if (opt_mmap)
+    conn_mapin (c);
+  if (opt_iothread)
+    io_start (c);
+#if HAVE_EPOLL
+  if (wk->epoll_fd >= 0
+      && (ev_add (&c->rsrc, c, c->rfd, EPOLLIN) < 0
+          || (c->wfd != c->rfd && ev_add (&c->wsrc, c, c->wfd, 0) < 0)
+          || (!server && ev_add (&c->nsrc, c, nfd, EPOLLIN) < 0))) {
+    perror ("epoll_ctl");
+    exit (1);
+  }
+#endif
+#if HAVE_IO_URING
+  if (wk->uring)
+    uring_attach (c);
+#endif
+  c->prev = &wk->conn_list;
+  c->next = wk->conn_list;
+  c->outqtail = &c->outq;
+  if (wk->conn_list)
+    wk->conn_list->prev = &c->next;
+  wk->conn_list = c;
+
+  wk->cevents_generation++;
+
+  return c;
+}
+
+
+
+/**
+ * conn_create - create a new network layer connection
+ * @param rel - reliable connection associated with this connection
+ * @param ss - sockaddr structure if running as server
+ * @returns pointer to new connection structure
+ */
+conn_t * conn_create (rdt_t *rel, const struct sockaddr_storage *ss) {
+  int n;
+  conn_t *c;
+
+  /* conn_create is only when the program is running as a server (and
+   * rdt_recvpkt is called with NULL packets.  If you call conn_create
+   * in the client, you will see this assertion fail. */
+  assert (serverconf);
+
+  if ((n = connect_to (0, &serverconf->dest)) < 0) {
+    char addr[NI_MAXHOST] = "unknown";
+    char port[NI_MAXSERV] = "unknown";
+    int saved_errno = errno;
+    getnameinfo ((const struct sockaddr *) &serverconf->dest,
+        sizeof (serverconf->dest),
+        addr, sizeof (addr), port, sizeof (port),
+        NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
+    fprintf (stderr, "%s:%s: connect: %s\n",
+        addr, port, strerror (saved_errno));
+    return NULL;
+  }
+
+  c = conn_alloc (n, n, wk->udp_socket, 1);
+  c->peer = *ss;
+  c->rel = rel;
+
+  return c;
+}
+
+
+
+/**
+ * conn_free() - deallocates connection information structure
+ * @param c connection information structure to delete
+ */
+static void conn_free (conn_t *c) {
+  if (c->outq) {
+    *c->outqtail = wk->chunk_pool;
+    wk->chunk_pool = c->outq;
+  }
+  if (c->inmap)
+    munmap ((void *) c->inmap, c->inmapsize);
+
+  if (c->next)
+    c->next->prev = c->prev;
+  *c->prev = c->next;
+
+#if HAVE_EPOLL
+  if (wk->epoll_fd >= 0) {
+    ev_flush ();
+    ev_del (&c->rsrc);
+    if (c->wfd != c->rfd)
+      ev_del (&c->wsrc);
+    if (!c->server)
+      ev_del (&c->nsrc);
+  }
+#endif
+#if HAVE_IO_URING
+  if (wk->uring)
+    uring_detach (c);
+#endif
+  if (c->io)
+    io_stop (c);
+  close (c->rfd);
+  if (c->wfd != c->rfd)
+    close (c->wfd);
+  if (!c->server)
+    close (c->nfd);
+
+  wk->cevents_generation++;
+
+  /* to help catch errors */
+  memset (c, 0xc5, sizeof (*c));
+  free (c);
+}
+
+
+
+/**
+ * conn_destroy() - marks a connection for removal
+ * @param c connection information structure to delete
+ */
+void conn_destroy (conn_t *c) {
+  if (c->delete_me)
+    return;
+  c->delete_me = 1;
+  c->nextdead = wk->conn_dead;
+  wk->conn_dead = c;
+}
+
+
+
+/**
+ * conn_drain() - process data returned from poll()
+ * @param c - connection state information
+ *
+ * Writes the output queue out with writev, up to IOV_MAX chunks a call.
+ */
+void conn_drain (conn_t *c) {
+  struct iovec iov[IOV_MAX];
+  chunk_t *ch;
+  int didsome = 0;
+
+  conn_want_write (c, 0);
+
+  if (c->write_err)
+    return;
+  while (c->outq) {
+    ssize_t n, want = 0;
+    int i = 0;
+
+    for (ch = c->outq; ch && i < IOV_MAX; ch = ch->next, i++) {
+      iov[i].iov_base = ch->buf + ch->used;
+      iov[i].iov_len = ch->size - ch->used;
+      want += iov[i].iov_len;
+    }
+    if ((n = writev (c->wfd, iov, i)) < 0) {
+      if (errno != EAGAIN)
+        c->write_err = 1;
+      else
+        conn_want_write (c, 1);
+      break;
+    }
+    didsome = 1;
+    outq_consume (c, n);
+    if (n < want) {
+      conn_want_write (c, 1);
+      break;
+    }
+  }
+  if (c->write_eof && !c->write_err && !c->outq) {
+    c->write_err = 1;
+    shutdown (c->wfd, SHUT_WR);
+  }
+  if (didsome && !c->delete_me)
+    rdt_output (c->rel);
+}
+
+
+
+/**
+ * conn_mkevents() - update poll() events
+ */
+static void conn_mkevents (void) {
+  struct pollfd *e;
+  conn_t **r, **w;
+  size_t n = 2;
+  conn_t *c;
+
+  for (c = wk->conn_list; c; c = c->next) {
+    if (c->io) {
+      /* just netwake, which is always wanted */
+      c->rpoll = n++;
+      c->wpoll = 0;
+      c->npoll = c->server ? 0 : n++;
+    }
+    else if (c->read_eof) {
+      c->rpoll = 0;
+      if (c->write_err)
+        c->wpoll = 0;
+      else
+        c->wpoll = n++;
+    }
+    else {
+      c->rpoll = n++;
+      if (c->write_err)
+        c->wpoll = 0;
+      else if (c->wfd == c->rfd)
+        c->wpoll = c->rpoll;
+      else
+        c->wpoll = n++;
+      if (c->server)
+        c->npoll = 0;
+      else
+        c->npoll = n++;
+    }
+  }
+
+  e = xmalloc (n * sizeof (*e));
+  memset (e, 0, n * sizeof (*e));
+  if (wk->cevents)
+    e[0] = wk->cevents[0];
+  else
+    e[0].fd = -1;
+  e[1].fd = 2;			/* Do catch errors on stderr */
+
+  for (c = wk->conn_list; c; c = c->next) {
+    if (c->rpoll) {
+      e[c->rpoll].fd = c->rfd;
+      if (!c->xoff || c->io)
+        e[c->rpoll].events |= POLLIN;
+    }
+    if (c->wpoll) {
+      e[c->wpoll].fd = c->wfd;
+      if (c->outq)
+        e[c->wpoll].events |= POLLOUT;
+    }
+    if (c->npoll) {
+      e[c->npoll].fd = c->nfd;
+      e[c->npoll].events |= POLLIN;
+    }
+  }
+
+  r = xmalloc (n * sizeof (*r));
+  memset (r, 0, n * sizeof (*r));
+  w = xmalloc (n * sizeof (*w));
+  memset (w, 0, n * sizeof (*w));
+  for (c = wk->conn_list; c; c = c->next) {
+    if (c->rpoll > 0)
+      r[c->rpoll] = c;
+    if (c->npoll > 0)
+      r[c->npoll] = c;
+    if (c->wpoll > 0)
+      w[c->wpoll] = c;
+  }
+
+  free (wk->cevents);
+  wk->cevents = e;
+  wk->ncevents = n;
+  free (wk->evreaders);
+  wk->evreaders = r;
+  free (wk->evwriters);
+  wk->evwriters = w;
+}
+
+
+
+/**
+ * server_recv() - hands a datagram on the shared UDP socket to rdt_demux
+ * @param cc - global config state
+ * @param fd - the server's UDP socket
+ */
+static void server_recv (const struct config_common *cc, int fd) {
+  packet_t pkt[RECV_BATCH];
+  int len[RECV_BATCH];
+  struct sockaddr_storage from[RECV_BATCH];
+  int i, n = debug_recvmmsg (fd, pkt, len, from, RECV_BATCH);
+
+  if (n < 0) {
+    if (errno != EAGAIN)
+      perror ("recvmmsg");
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    rdt_demux (cc, &from[i], &pkt[i], len[i]);
+    memset (&pkt[i], 0xc9, len[i]); /* for debugging */
+  }
+}
+
+
+
+/**
+ * conn_netin() - hands a datagram on a client's socket to rdt_recvpkt
+ * @param c - connection state information
+ */
+static void conn_netin (conn_t *c) {
+  packet_t pkt[RECV_BATCH];
+  int len[RECV_BATCH];
+  int i, n = debug_recvmmsg (c->nfd, pkt, len, NULL, RECV_BATCH);
+
+  if (n < 0) {
+    if (errno != EAGAIN)
+      perror ("recvmmsg");
+    return;
+  }
+  for (i = 0; i < n && !c->delete_me; i++) {
+    rdt_recvpkt (c->rel, &pkt[i], len[i]);
+    memset (&pkt[i], 0xc9, len[i]); /* for debugging */
+  }
+}
+
+
+
+/**
+ * conn_neterr() - gives up on a peer whose socket reports an error
+ * @param cc - global config state
+ * @param c - connection state information
+ */
+static void conn_neterr (const struct config_common *cc, conn_t *c) {
+  char addr[NI_MAXHOST] = "unknown";
+  char port[NI_MAXSERV] = "unknown";
+
+  getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+      addr, sizeof (addr), port, sizeof (port),
+      NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
+  fprintf (stderr, "[received ICMP port unreachable;"
+      " assuming peer at %s:%s is dead]\n", addr, port);
+  if (cc->single_connection)
+    exit (1);
+  rdt_destroy (c->rel);
+}
+
+
+
+/**
+ * conn_readable() - lets the reliable layer read from rfd
+ * @param c - connection state information
+ *
+ * Reading stays paused until rdt_read (or a later rdt_output) calls
+ * conn_input, so a sender with a full window is not woken up again.
+ */
+static void conn_readable (conn_t *c) {
+  if (c->io) {
+    io_wake (c);
+    return;
+  }
+  c->xoff = 1;
+  conn_want_read (c, 0);
+  rdt_read (c->rel);
+}
+
+
+
+/**
+ * conn_pollfds() - one pass of the portable poll() loop
+ * @param cc - global config state
+ * @param timeout - microseconds to wait for I/O, -1 for no limit
+ */
+static void conn_pollfds (const struct config_common *cc, long timeout) {
+  struct timespec ts, *tsp = NULL;
+  int i;
+  conn_t *c;
+
+  if (wk->last_cg != wk->cevents_generation) {
+    conn_mkevents ();
+    wk->cevents_generation = wk->last_cg;
+  }
+
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000000;
+    ts.tv_nsec = timeout % 1000000 * 1000;
+    tsp = &ts;
+  }
+  if (wk->cevents[0].fd >= 0)
+    ppoll (wk->cevents, wk->ncevents, tsp, NULL);
+  else
+    ppoll (wk->cevents+1, wk->ncevents-1, tsp, NULL);
+
+  /* server: every client shares the UDP socket in cevents[0] */
+  if (wk->cevents[0].revents & POLLIN)
+    server_recv (cc, wk->cevents[0].fd);
+  wk->cevents[0].revents = 0;
+
+  for (i = 1; i < wk->ncevents; i++) {
+    if (wk->cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
+      if ((c = wk->evreaders[i]) && !c->delete_me) {
+        if (wk->cevents[i].fd == c->rfd)
+          conn_readable (c);
+        else if (wk->cevents[i].fd == c->nfd
+            && (wk->cevents[i].revents & (POLLERR|POLLHUP)))
+          conn_neterr (cc, c);
+        else if (wk->cevents[i].fd == c->nfd && !c->server)
+          conn_netin (c);
+      }
+    }
+    if ((wk->cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
+        && wk->evwriters[i])
+      conn_drain (wk->evwriters[i]);
+    if (wk->cevents[i].revents & (POLLHUP|POLLERR)) {
+      /* If stderr has an error, the tester has probably died, so exit
+       * immediately. */
+      if (wk->cevents[i].fd == 2)
+        exit (1);
+      wk->cevents[i].fd = -1;
+    }
+    wk->cevents[i].revents = 0;
+  }
+}
+
+
+
+#if HAVE_EPOLL
+/**
+ * ev_dispatch() - handles the events reported for one source
+ * @param cc - global config state
+ * @param src - source the events belong to
+ * @param events - EPOLL* bits that are ready
+ */
+static void ev_dispatch (const struct config_common *cc,
+    struct evsrc *src, uint32_t events) {
+  conn_t *c = src->c;
+
+  if (src == &wk->server_src) {
+    if (events & EPOLLIN)
+      server_recv (cc, src->fd);
+    return;
+  }
+  if (src == &wk->stderr_src) {
+    /* If stderr has an error, the tester has probably died, so exit
+     * immediately. */
+    if (events & (EPOLLERR|EPOLLHUP))
+      exit (1);
+    return;
+  }
+
+  if (src == &c->nsrc) {
+    if (c->delete_me)
+      ;
+    else if (events & (EPOLLERR|EPOLLHUP))
+      conn_neterr (cc, c);
+    else if (events & EPOLLIN)
+      conn_netin (c);
+  }
+  else {
+    if ((events & (EPOLLIN|EPOLLERR|EPOLLHUP)) && (src->want & EPOLLIN)
+        && !c->delete_me)
+      conn_readable (c);
+    if ((events & (EPOLLOUT|EPOLLERR|EPOLLHUP)) && src == conn_wsrc (c))
+      conn_drain (c);
+  }
+
+  /* Error and hangup are reported whether wanted or not, so rather
+   * than spin on them, stop watching: from now on the descriptor
+   * never blocks and is serviced whenever its events are wanted. */
+  if ((events & (EPOLLERR|EPOLLHUP)) && src->fd >= 0 && !src->nopoll) {
+    epoll_ctl (wk->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+    ev_nopoll_link (src);
+  }
+}
+
+
+
+/**
+ * ev_wait() - epoll_wait with a timeout finer than a millisecond
+ * @param ev - returned events
+ * @param n - room in ev
+ * @param timeout - microseconds to wait, -1 for no limit
+ * @returns as epoll_wait
+ *
+ * Uses epoll_pwait2 (Linux 5.11) when it is there, and otherwise
+ * rounds up to whole milliseconds.
+ */
+static int ev_wait (struct epoll_event *ev, int n, long timeout) {
+#ifdef __NR_epoll_pwait2
+  static __thread int no_pwait2;
+  struct timespec ts;
+  int r;
+
+  if (timeout > 0 && timeout % 1000 && !no_pwait2) {
+    ts.tv_sec = timeout / 1000000;
+    ts.tv_nsec = timeout % 1000000 * 1000;
+    r = syscall (__NR_epoll_pwait2, wk->epoll_fd, ev, n, &ts, NULL, 0);
+    if (r >= 0 || errno != ENOSYS)
+      return r;
+    no_pwait2 = 1;
+  }
+#endif
+  return epoll_wait (wk->epoll_fd, ev, n, timeout > 0
+      ? (timeout + 999) / 1000 : timeout);
+}
+
+
+
+/**
+ * conn_epoll() - one pass of the epoll loop
+ * @param cc - global config state
+ * @param timeout - microseconds to wait for I/O, -1 for no limit
+ *
+ * Only descriptors with something to report are visited, so the cost
+ * of a pass does not grow with the number of idle connections.
+ */
+static void conn_epoll (const struct config_common *cc, long timeout) {
+  struct epoll_event ev[64];
+  struct evsrc *src, *nsrc;
+  int i, n;
+
+  ev_flush ();
+  for (src = wk->ev_nopoll; src; src = src->nextnopoll)
+    if (src->want) {
+      timeout = 0;
+      break;
+    }
+
+  n = ev_wait (ev, sizeof (ev) / sizeof (ev[0]), timeout);
+  for (i = 0; i < n; i++)
+    ev_dispatch (cc, ev[i].data.ptr, ev[i].events);
+
+  for (src = wk->ev_nopoll; src; src = nsrc) {
+    nsrc = src->nextnopoll;
+    if (src->want)
+      ev_dispatch (cc, src, src->want);
+  }
+}
+#endif
+
+
+
+#if HAVE_IO_URING
+/**
+ * uring_enter() - io_uring_enter(2), which glibc does not wrap
+ */
+static int uring_enter (unsigned submit, unsigned wait, unsigned flags,
+    const void *arg, size_t argsz) {
+  return syscall (__NR_io_uring_enter, wk->uring->fd, submit, wait, flags,
+      arg, argsz);
+}
+
+
+
+/**
+ * uring_unsubmitted() - counts SQEs the kernel has not consumed yet
+ */
+static unsigned uring_unsubmitted (void) {
+  return *wk->uring->sqtail - __atomic_load_n (wk->uring->sqhead, __ATOMIC_ACQUIRE);
+}
+
+
+
+/**
+ * uop_get() - allocates an operation
+ * @param c - owning connection, or NULL
+ * @param kind - what the operation is for
+ * @param fd - descriptor it works on
+ * @returns the new operation, without a buffer
+ */
+static struct uop * uop_get (conn_t *c, enum uop_kind kind, int fd) {
+  struct uop *op = wk->uring->freeops;
+
+  if (op)
+    wk->uring->freeops = op->next;
+  else
+    op = xmalloc (sizeof (*op));
+  memset (op, 0, sizeof (*op));
+  op->c = c;
+  op->kind = kind;
+  op->fd = fd;
+  op->slot = -1;
+  if (c) {
+    op->prev = &c->uops;
+    op->next = c->uops;
+    if (c->uops)
+      c->uops->prev = &op->next;
+    c->uops = op;
+  }
+  return op;
+}
+
+
+
+/**
+ * uop_buf() - gives an operation a buffer of UBUF_SIZE bytes
+ * @param op - operation without a buffer
+ *
+ * Buffers come from the registered arena while it lasts.
+ */
+static void uop_buf (struct uop *op) {
+  if (wk->uring->nfree) {
+    op->slot = wk->uring->freeslot[--wk->uring->nfree];
+    op->buf = wk->uring->arena + (size_t) op->slot * UBUF_SIZE;
+  }
+  else
+    op->buf = xmalloc (UBUF_SIZE);
+}
+
+
+
+/**
+ * uop_disown() - detaches an operation from its connection
+ * @param op - operation
+ */
+static void uop_disown (struct uop *op) {
+  if (!op->c)
+    return;
+  if (op->next)
+    op->next->prev = op->prev;
+  *op->prev = op->next;
+  op->c = NULL;
+}
+
+
+
+/**
+ * uop_put() - frees an operation that is not in flight
+ * @param op - operation
+ *
+ * Operations are recycled rather than freed, so a stale user_data
+ * never points at memory returned to malloc.
+ */
+static void uop_put (struct uop *op) {
+  assert (!op->busy);
+  uop_disown (op);
+  if (op->slot >= 0)
+    wk->uring->freeslot[wk->uring->nfree++] = op->slot;
+  else
+    free (op->buf);
+  op->buf = NULL;
+  op->next = wk->uring->freeops;
+  wk->uring->freeops = op;
+}
+
+
+
+/**
+ * uop_submit() - queues an operation on the submission ring
+ * @param op - operation, with buf and len set for transfers
+ *
+ * Nothing reaches the kernel until the next conn_uring, so everything
+ * queued in one pass of the loop is submitted with one system call.
+ */
+static void uop_submit (struct uop *op) {
+  struct io_uring_sqe *sqe;
+  unsigned tail = *wk->uring->sqtail;
+  int fixed = wk->uring->fixed && op->slot >= 0;
+
+  if (tail - __atomic_load_n (wk->uring->sqhead, __ATOMIC_ACQUIRE)
+      == wk->uring->sqentries && uring_enter (uring_unsubmitted (), 0, 0,
+        NULL, 0) < 0) {
+    perror ("io_uring_enter");
+    exit (1);
+  }
+  sqe = &wk->uring->sqes[tail & wk->uring->sqmask];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->fd = op->fd;
+  sqe->user_data = (uintptr_t) op;
+
+  if (op->polling) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = op->kind == UOP_WRITE || op->kind == UOP_SEND
+      ? POLLOUT : POLLIN;
+  }
+  else if (op->kind == UOP_ERRWATCH) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLERR|POLLHUP;
+  }
+  else if (op->kind == UOP_CANCEL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) op->target;
+  }
+  else if (op->kind == UOP_SRVRECV
+      || (op->kind == UOP_SEND && op->c && op->c->server)) {
+    /* the server's socket is unconnected, so addresses travel along */
+    memset (&op->msg, 0, sizeof (op->msg));
+    op->iov.iov_base = op->buf;
+    op->iov.iov_len = op->len;
+    op->msg.msg_name = &op->addr;
+    op->msg.msg_namelen = op->kind == UOP_SEND
+      ? addrsize (&op->addr) : sizeof (op->addr);
+    op->msg.msg_iov = &op->iov;
+    op->msg.msg_iovlen = 1;
+    sqe->opcode = op->kind == UOP_SEND ? IORING_OP_SENDMSG
+      : IORING_OP_RECVMSG;
+    sqe->addr = (uintptr_t) &op->msg;
+    sqe->len = 1;
+  }
+  else {
+    /* plain read/write also covers a connected datagram socket */
+    if (op->kind == UOP_READ || op->kind == UOP_NETRECV)
+      sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    else
+      sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->addr = (uintptr_t) op->buf;
+    sqe->len = op->len;
+    sqe->off = (uint64_t) -1;       /* current file position */
+    sqe->buf_index = 0;
+  }
+
+  op->busy = 1;
+  __atomic_store_n (wk->uring->sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+
+/**
+ * uring_init() - sets up the io_uring engine
+ * @returns 0 on success, -1 (after saying why) if it is unavailable
+ *
+ * Needs a kernel that takes a wait timeout in io_uring_enter (5.11).
+ * If the registered buffer arena cannot be locked in memory, the
+ * engine still works, using plain reads and writes.
+ */
+static int uring_init (void) {
+  struct io_uring_params p;
+  const unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP
+    | IORING_FEAT_RW_CUR_POS | IORING_FEAT_EXT_ARG;
+  struct uring *u;
+  struct iovec iov;
+  size_t sqsize, cqsize;
+  char *ring;
+  int fd, i;
+
+  memset (&p, 0, sizeof (p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_CQ;
+  if ((fd = syscall (__NR_io_uring_setup, URING_SQ, &p)) < 0) {
+    perror ("io_uring_setup");
+    return -1;
+  }
+  if ((p.features & need) != need) {
+    fprintf (stderr, "[io_uring lacks needed features; not using it]\n");
+    close (fd);
+    return -1;
+  }
+
+  sqsize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  cqsize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  ring = mmap (NULL, sqsize > cqsize ? sqsize : cqsize,
+      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) {
+    perror ("mmap");
+    close (fd);
+    return -1;
+  }
+
+  u = xmalloc (sizeof (*u));
+  memset (u, 0, sizeof (*u));
+  u->fd = fd;
+  u->sqhead = (unsigned *) (ring + p.sq_off.head);
+  u->sqtail = (unsigned *) (ring + p.sq_off.tail);
+  u->sqarray = (unsigned *) (ring + p.sq_off.array);
+  u->sqmask = *(unsigned *) (ring + p.sq_off.ring_mask);
+  u->sqentries = p.sq_entries;
+  u->cqhead = (unsigned *) (ring + p.cq_off.head);
+  u->cqtail = (unsigned *) (ring + p.cq_off.tail);
+  u->cqmask = *(unsigned *) (ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+  u->sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    perror ("mmap");
+    exit (1);
+  }
+  /* SQE i always sits in SQ ring position i */
+  for (i = 0; i < p.sq_entries; i++)
+    u->sqarray[i] = i;
+
+  u->arena = mmap (NULL, UBUF_SLOTS * UBUF_SIZE, PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (u->arena == MAP_FAILED) {
+    perror ("mmap");
+    exit (1);
+  }
+  iov.iov_base = u->arena;
+  iov.iov_len = UBUF_SLOTS * UBUF_SIZE;
+  u->fixed = syscall (__NR_io_uring_register, fd,
+      IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+  for (i = 0; i < UBUF_SLOTS; i++)
+    u->freeslot[u->nfree++] = UBUF_SLOTS - 1 - i;
+
+  wk->uring = u;
+  uop_submit (uop_get (NULL, UOP_ERRWATCH, 2));
+  return 0;
+}
+
+
+
+/**
+ * uring_listen() - keeps receives posted on the server's UDP socket
+ * @param fd - the server's UDP socket
+ */
+static void uring_listen (int fd) {
+  int i;
+
+  for (i = 0; i < URING_SRVRECV; i++) {
+    struct uop *op = uop_get (NULL, UOP_SRVRECV, fd);
+    uop_buf (op);
+    op->len = sizeof (packet_t);
+    uop_submit (op);
+  }
+}
+
+
+
+/**
+ * uring_attach() - starts the operations a new connection always has
+ * @param c - connection state information
+ *
+ * Input is read ahead into one buffer; a client also keeps several
+ * receives posted on its own socket.
+ */
+static void uring_attach (conn_t *c) {
+  struct uop *op;
+  int i;
+
+  op = c->urd = uop_get (c, UOP_READ, c->rfd);
+  uop_buf (op);
+  op->len = UBUF_SIZE;
+  uop_submit (op);
+
+  for (i = 0; !c->server && i < URING_NETRECV; i++) {
+    op = uop_get (c, UOP_NETRECV, c->nfd);
+    uop_buf (op);
+    op->len = sizeof (packet_t);
+    uop_submit (op);
+  }
+}
+
+
+
+/**
+ * uring_detach() - abandons a connection's operations before conn_free
+ * @param c - connection state information
+ *
+ * Those still in flight are cancelled and freed when they complete.
+ * Everything queued is submitted right away, so that c's last packets
+ * go out even if the program is about to exit.
+ */
+static void uring_detach (conn_t *c) {
+  struct uop *op, *cancel;
+
+  while ((op = c->uops)) {
+    uop_disown (op);
+    if (!op->busy) {
+      uop_put (op);
+      continue;
+    }
+    cancel = uop_get (NULL, UOP_CANCEL, -1);
+    cancel->target = op;
+    uop_submit (cancel);
+  }
+  c->urd = c->uwr = NULL;
+  if (uring_enter (uring_unsubmitted (), 0, 0, NULL, 0) < 0)
+    perror ("io_uring_enter");
+}
+
+
+
+/**
+ * uring_input() - conn_input's read(), served from the read-ahead buffer
+ * @param c - connection state information
+ * @param buf - buffer to read into
+ * @param n - max size of buffer
+ * @returns what read() would: bytes, 0 on EOF, -1 with errno set
+ */
+static int uring_input (conn_t *c, void *buf, size_t n) {
+  struct uop *op = c->urd;
+  int res;
+
+  if (!op || op->busy) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if ((res = op->res) <= 0) {
+    c->urd = NULL;
+    uop_put (op);
+    errno = -res;
+    return res ? -1 : 0;
+  }
+
+  if (n > res - op->off)
+    n = res - op->off;
+  memcpy (buf, op->buf + op->off, n);
+  op->off += n;
+  if (op->off == res) {
+    op->len = UBUF_SIZE;
+    uop_submit (op);
+  }
+  return n;
+}
+
+
+
+/**
+ * uring_sendpkt() - conn_sendref through the submission ring
+ * @param c - connection state information
+ * @param pkt - packet to send
+ * @param len - sizeof packet
+ * @param at - offset in pkt where ref goes
+ * @param ref - data spliced in, copied here like the rest
+ * @param reflen - size of ref
+ * @returns # of bytes sent; like any datagram, the packet may be lost
+ */
+static int uring_sendpkt (conn_t *c, const packet_t *pkt, size_t len,
+    size_t at, const void *ref, size_t reflen) {
+  struct uop *op = uop_get (c, UOP_SEND, c->nfd);
+
+  assert (len + reflen <= UBUF_SIZE);
+  uop_buf (op);
+  memcpy (op->buf, pkt, at);
+  if (reflen)
+    memcpy (op->buf + at, ref, reflen);
+  memcpy (op->buf + at + reflen, (const char *) pkt + at, len - at);
+  op->len = len + reflen;
+  op->addr = c->peer;
+  uop_submit (op);
+  if (opt_debug)
+    print_pkt (pkt, "send", len + reflen);
+  return len + reflen;
+}
+
+
+
+/**
+ * uring_write() - starts writing the output queue, if not already
+ * @param c - connection state information
+ *
+ * Copies as much of the queue as fits into one buffer; the chunks stay
+ * queued, and count against conn_bufspace, until the write completes.
+ */
+static void uring_write (conn_t *c) {
+  struct uop *op;
+  chunk_t *ch;
+  size_t n = 0;
+
+  if (c->uwr || c->write_err || !c->outq)
+    return;
+
+  op = c->uwr = uop_get (c, UOP_WRITE, c->wfd);
+  uop_buf (op);
+  for (ch = c->outq; ch && n < UBUF_SIZE; ch = ch->next) {
+    size_t k = ch->size - ch->used;
+    if (k > UBUF_SIZE - n)
+      k = UBUF_SIZE - n;
+    memcpy (op->buf + n, ch->buf + ch->used, k);
+    n += k;
+  }
+  op->len = n;
+  uop_submit (op);
+}
+
+
+
+/**
+ * uring_written() - retires output once its write completes
+ * @param c - connection state information
+ * @param res - result of the write
+ */
+static void uring_written (conn_t *c, int res) {
+  if (res < 0) {
+    c->write_err = 1;
+    return;
+  }
+  outq_consume (c, res);
+  if (c->write_eof && !c->outq) {
+    c->write_err = 1;
+    shutdown (c->wfd, SHUT_WR);
+  }
+  uring_write (c);
+  if (!c->delete_me)
+    rdt_output (c->rel);
+}
+
+
+
+/**
+ * uop_done() - handles one completion
+ * @param cc - global config state
+ * @param op - operation that completed
+ * @param res - its result: a byte count or poll mask, or -errno
+ */
+static void uop_done (const struct config_common *cc, struct uop *op,
+    int res) {
+  conn_t *c = op->c;
+
+  op->busy = 0;
+  if (!c && op->kind != UOP_SRVRECV && op->kind != UOP_ERRWATCH) {
+    /* orphaned by uring_detach, or a cancellation */
+    uop_put (op);
+    return;
+  }
+
+  /* a descriptor left non-blocking: wait for readiness, then retry */
+  if (op->polling) {
+    op->polling = 0;
+    uop_submit (op);
+    return;
+  }
+  if (res == -EAGAIN) {
+    op->polling = 1;
+    uop_submit (op);
+    return;
+  }
+
+  switch (op->kind) {
+  case UOP_SRVRECV:
+    errno = -res;
+    if (opt_debug)
+      print_pkt ((packet_t *) op->buf, "recv", res < 0 ? -1 : res);
+    if (res >= 0)
+      rdt_demux (cc, &op->addr, (packet_t *) op->buf, res);
+    else if (res != -EINTR)
+      perror ("recvmsg");
+    uop_submit (op);
+    break;
+
+  case UOP_NETRECV:
+    if (c->delete_me) {
+      uop_put (op);
+      break;
+    }
+    errno = -res;
+    if (opt_debug)
+      print_pkt ((packet_t *) op->buf, "recv", res < 0 ? -1 : res);
+    if (res >= 0)
+      rdt_recvpkt (c->rel, (packet_t *) op->buf, res);
+    else if (res == -ECONNREFUSED)
+      conn_neterr (cc, c);
+    else if (res != -EINTR)
+      perror ("recv");
+    if (c->delete_me)
+      uop_put (op);
+    else
+      uop_submit (op);
+    break;
+
+  case UOP_SEND:
+    uop_put (op);
+    break;
+
+  case UOP_READ:
+    op->res = res;
+    op->off = 0;
+    if (!c->delete_me)
+      conn_readable (c);
+    break;
+
+  case UOP_WRITE:
+    c->uwr = NULL;
+    uop_put (op);
+    uring_written (c, res);
+    break;
+
+  case UOP_ERRWATCH:
+    /* If stderr has an error, the tester has probably died, so exit
+     * immediately. */
+    if (res > 0 && (res & (POLLERR|POLLHUP)))
+      exit (1);
+    uop_put (op);
+    break;
+
+  case UOP_CANCEL:
+    break;
+  }
+}
 
-  /* conn_create is only when the program is running as a server (and
-   * rdt_recvpkt is called with NULL packets.  If you call conn_create
-   * in the client, you will see this assertion fail. */
-  assert (serverconf);
 
-  if ((n = connect_to (0, &serverconf->dest)) < 0) {
-    char addr[NI_MAXHOST] = "unknown";
-    char port[NI_MAXSERV] = "unknown";
-    int saved_errno = errno;
-    getnameinfo ((const struct sockaddr *) &serverconf->dest,
-        sizeof (serverconf->dest),
-        addr, sizeof (addr), port, sizeof (port),
-        NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
-    fprintf (stderr, "%s:%s: connect: %s\n",
-        addr, port, strerror (saved_errno));
-    return NULL;
+
+/**
+ * conn_uring() - one pass of the io_uring loop
+ * @param cc - global config state
+ * @param timeout - microseconds to wait for a completion, -1 for no limit
+ *
+ * Submits everything queued since the last pass and waits in the same
+ * system call, then dispatches the completions.
+ */
+static void conn_uring (const struct config_common *cc, long timeout) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned head = *wk->uring->cqhead;
+  unsigned wait = 0;
+  unsigned flags = IORING_ENTER_EXT_ARG;
+
+  memset (&arg, 0, sizeof (arg));
+  if (timeout && head == __atomic_load_n (wk->uring->cqtail, __ATOMIC_ACQUIRE)) {
+    wait = 1;
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout > 0) {
+      ts.tv_sec = timeout / 1000000;
+      ts.tv_nsec = timeout % 1000000 * 1000;
+      arg.ts = (uintptr_t) &ts;
+    }
+  }
+  if ((wait || uring_unsubmitted ())
+      && uring_enter (uring_unsubmitted (), wait, flags, &arg, sizeof (arg)) < 0
+      && errno != ETIME && errno != EINTR) {
+    perror ("io_uring_enter");
+    exit (1);
   }
 
-  c = conn_alloc ();
-  c->peer = *ss;
-  c->rel = rel;
-  c->nfd = serverconf->udp_socket;
-  c->rfd = c->wfd = n;
-  c->server = 1;
+  while (head != __atomic_load_n (wk->uring->cqtail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &wk->uring->cqes[head & wk->uring->cqmask];
+    struct uop *op = (struct uop *) (uintptr_t) cqe->user_data;
+    int res = cqe->res;
 
-  return c;
+    __atomic_store_n (wk->uring->cqhead, ++head, __ATOMIC_RELEASE);
+    uop_done (cc, op, res);
+  }
 }
+#else
+static int uring_init (void) {
+  fprintf (stderr, "[built without io_uring; not using it]\n");
+  return -1;
+}
+#endif
 
 
 
 /**
- * conn_free() - deallocates connection information structure
- * @param c connection information structure to delete
+ * conn_poll() - main asynchronous I/O handler / poll() loop
+ * @param cc - global config state
  */
-static void conn_free (conn_t *c) {
-  chunk_t *ch, *nch;
+void conn_poll (const struct config_common *cc) {
+  conn_t *c, **cp;
+  long timeout, pace;
+
+  /* sleep until I/O or the reliable layer's next deadline, if any;
+   * paced sends fall due at a much finer grain than retransmissions */
+  timeout = rdt_timeout ();
+  if (timeout > INT_MAX / 1000)
+    timeout = INT_MAX / 1000;
+  if (timeout > 0)
+    timeout *= 1000;
+  pace = rdt_pace_timeout ();
+  if (pace >= 0 && (timeout < 0 || pace < timeout))
+    timeout = pace;
+#if HAVE_IO_URING
+  if (wk->uring)
+    conn_uring (cc, timeout);
+  else
+#endif
+#if HAVE_EPOLL
+  if (wk->epoll_fd >= 0)
+    conn_epoll (cc, timeout);
+  else
+#endif
+    conn_pollfds (cc, timeout);
+
+  if (rdt_timeout () == 0)
+    rdt_timer ();
+  if (rdt_pace_timeout () == 0)
+    rdt_pace ();
+  sendq_flush ();
 
-  for (ch = c->outq; ch; ch = nch) {
-    nch = ch->next;
-    free (ch);
+  for (cp = &wk->conn_dead; (c = *cp);) {
+    if (c->write_err || !c->outq) {
+      *cp = c->nextdead;
+      conn_free (c);
+    }
+    else
+      cp = &c->nextdead;
   }
+}
 
-  if (c->next)
-    c->next->prev = c->prev;
-  *c->prev = c->next;
 
-  close (c->rfd);
-  if (c->wfd != c->rfd)
-    close (c->wfd);
-  if (!c->server)
-    close (c->nfd);
 
-  cevents_generation++;
+/**
+ * clock_ms() - reads the monotonic clock in milliseconds
+ * @returns milliseconds since an arbitrary fixed point
+ */
+uint64_t clock_ms (void) {
+  struct timespec ts;
 
-  /* to help catch errors */
-  memset (c, 0xc5, sizeof (*c));
-  free (c);
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 
 
 /**
- * conn_destroy() - marks a connection for removal
- * @param c connection information structure to delete
+ * clock_us() - reads the monotonic clock in microseconds
+ * @returns microseconds since an arbitrary fixed point
  */
-void conn_destroy (conn_t *c) {
-  c->delete_me = 1;
+uint64_t clock_us (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 
 
 /**
- * conn_drain() - process data returned from poll()
- * @param c - connection state information
+ * twheel_init() - prepares an empty timing wheel
+ * @param w - wheel to initialize
  */
-void conn_drain (conn_t *c) {
-  chunk_t *ch;
-  int didsome = 0;
+void twheel_init (struct twheel *w) {
+  memset (w, 0, sizeof (*w));
+  w->now = clock_ms ();
+}
 
-  if (c->wpoll)
-    cevents[c->wpoll].events &= ~POLLOUT;
 
-  if (c->write_err)
-    return;
 
-  while ((ch = c->outq)) {
-    int n = write (c->wfd, ch->buf + ch->used,
-        ch->size - ch->used);
-    if (n < 0) {
-      if (errno != EAGAIN)
-        c->write_err = 1;
-      break;
-    }
-    didsome = 1;
-    ch->used += n;
-    if (ch->used < ch->size) {
-      if (c->wpoll)
-        cevents[c->wpoll].events |= POLLOUT;
-      break;
-    }
-    c->outq = ch->next;
-    if (!c->outq)
-      c->outqtail = &c->outq;
-    free (ch);
+/**
+ * twheel_link() - files a timer in the bucket matching its deadline
+ * @param w - timing wheel
+ * @param t - timer with expires already set
+ */
+static void twheel_link (struct twheel *w, struct rtimer *t) {
+  uint64_t when = t->expires;
+  uint64_t delta = when - w->now;
+  const uint64_t horizon = (uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS);
+  struct rtimer **head;
+  int level;
+
+  if ((int64_t) delta < 0) {
+    /* already due: fire on the next tick processed */
+    when = w->now;
+    delta = 0;
   }
-  if (c->write_eof && !c->write_err && !c->outq) {
-    c->write_err = 1;
-    shutdown (c->wfd, SHUT_WR);
+  else if (delta >= horizon) {
+    /* beyond the wheel's horizon; re-filed when its bucket cascades */
+    when = w->now + horizon - 1;
+    delta = horizon - 1;
   }
-  if (didsome && !c->delete_me)
-    rdt_output (c->rel);
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    if (delta < (uint64_t) 1 << (WHEEL_BITS * (level + 1)))
+      break;
+
+  head = &w->slot[level][(when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+  t->next = *head;
+  t->prev = head;
+  if (*head)
+    (*head)->prev = &t->next;
+  *head = t;
 }
 
 
 
 /**
- * conn_mkevents() - update poll() events
+ * timer_unlink() - removes a pending timer from its bucket
+ * @param t - timer to remove
  */
-static void conn_mkevents (void) {
-  struct pollfd *e;
-  conn_t **r, **w;
-  size_t n = 2;
-  conn_t *c;
+static void timer_unlink (struct rtimer *t) {
+  if (t->next)
+    t->next->prev = t->prev;
+  *t->prev = t->next;
+  t->next = NULL;
+  t->prev = NULL;
+}
 
-  for (c = conn_list; c; c = c->next) {
-    if (c->read_eof) {
-      c->rpoll = 0;
-      if (c->write_err)
-        c->wpoll = 0;
-      else
-        c->wpoll = n++;
-    }
-    else {
-      c->rpoll = n++;
-      if (c->write_err)
-        c->wpoll = 0;
-      else if (c->wfd == c->rfd)
-        c->wpoll = c->rpoll;
-      else
-        c->wpoll = n++;
-      if (c->server)
-        c->npoll = 0;
-      else
-        c->npoll = n++;
-    }
-  }
 
-  e = xmalloc (n * sizeof (*e));
-  memset (e, 0, n * sizeof (*e));
-  if (cevents)
-    e[0] = cevents[0];
+
+/**
+ * timer_set() - arms a timer, replacing any deadline it already had
+ * @param w - timing wheel
+ * @param t - timer to arm; fn and arg must be set
+ * @param ms - milliseconds from now until it fires
+ */
+void timer_set (struct twheel *w, struct rtimer *t, long ms) {
+  if (t->prev)
+    timer_unlink (t);
   else
-    e[0].fd = -1;
-  e[1].fd = 2;			/* Do catch errors on stderr */
+    w->count++;
+  t->expires = clock_ms () + ms;
+  twheel_link (w, t);
+}
 
-  for (c = conn_list; c; c = c->next) {
-    if (c->rpoll) {
-      e[c->rpoll].fd = c->rfd;
-      if (!c->xoff)
-        e[c->rpoll].events |= POLLIN;
-    }
-    if (c->wpoll) {
-      e[c->wpoll].fd = c->wfd;
-      if (c->outq)
-        e[c->wpoll].events |= POLLOUT;
-    }
-    if (c->npoll) {
-      e[c->npoll].fd = c->nfd;
-      e[c->npoll].events |= POLLIN;
-    }
-  }
 
-  r = xmalloc (n * sizeof (*r));
-  memset (r, 0, n * sizeof (*r));
-  w = xmalloc (n * sizeof (*w));
-  memset (w, 0, n * sizeof (*w));
-  for (c = conn_list; c; c = c->next) {
-    if (c->rpoll > 0)
-      r[c->rpoll] = c;
-    if (c->npoll > 0)
-      r[c->npoll] = c;
-    if (c->wpoll > 0)
-      w[c->wpoll] = c;
-  }
 
-  free (cevents);
-  cevents = e;
-  ncevents = n;
-  free (evreaders);
-  evreaders = r;
-  free (evwriters);
-  evwriters = w;
+/**
+ * timer_cancel() - disarms a timer
+ * @param w - timing wheel
+ * @param t - timer to disarm
+ */
+void timer_cancel (struct twheel *w, struct rtimer *t) {
+  if (!t->prev)
+    return;
+  timer_unlink (t);
+  w->count--;
 }
 
 
 
 /**
- * need_timer_in() - calculates future timer timestamps
- * @param last the last time the timer was set
- * @param timer timestamp when we want timer to expire
- * @returns new delta between now and desired time
+ * twheel_cascade() - re-files one upper-level bucket into lower levels
+ * @param w - timing wheel
+ * @param level - level of the bucket
+ * @param index - bucket within the level
+ * @returns index, so callers stop cascading unless it wrapped to 0
  */
-long need_timer_in (const struct timespec *last, long timer) {
-  long to;
-  struct timespec ts;
-
-  clock_gettime (CLOCK_MONOTONIC, &ts);
-  to = ts.tv_sec - last->tv_sec;
-  if (to > timer / 1000)
-    return 0;
-  to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-  if (to >= timer)
-    return 0;
-  return
-    timer - to;
+static int twheel_cascade (struct twheel *w, int level, int index) {
+  struct rtimer *t = w->slot[level][index];
+
+  w->slot[level][index] = NULL;
+  while (t) {
+    struct rtimer *nt = t->next;
+    twheel_link (w, t);
+    t = nt;
+  }
+  return index;
 }
 
 
 
 /**
- * conn_poll() - main asynchronous I/O handler / poll() loop
- * @param cc - global config state
+ * twheel_run() - advances the wheel, firing every expired timer
+ * @param w - timing wheel
+ * @param now - current time from clock_ms()
  */
-void conn_poll (const struct config_common *cc) {
-  int i;
-  conn_t *c, *nc;
-  static int last_cg;
-
-  if (last_cg != cevents_generation) {
-    conn_mkevents ();
-    cevents_generation = last_cg;
-  }
-
-  if (cevents[0].fd >= 0)
-    poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
-  else
-    poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
-
-  for (i = 1; i < ncevents; i++) {
-    if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
-      if ((c = evreaders[i]) && !c->delete_me) {
-        if (cevents[i].fd == c->rfd) {
-          c->xoff = 1;
-          cevents[i].events &= ~POLLIN;
-          rdt_read (c->rel);
-        }
-        else if (cevents[i].fd == c->nfd
-            && (cevents[i].revents & (POLLERR|POLLHUP))) {
-          char addr[NI_MAXHOST] = "unknown";
-          char port[NI_MAXSERV] = "unknown";
-          getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
-              addr, sizeof (addr), port, sizeof (port),
-              NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
-          fprintf (stderr, "[received ICMP port unreachable;"
-              " assuming peer at %s:%s is dead]\n", addr, port);
-          if (cc->single_connection)
-            exit (1);
-          rdt_destroy (c->rel);
-        }
-        else if (cevents[i].fd == c->nfd && !c->server) {
-          packet_t pkt;
-          int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
-          if (len < 0) {
-            if (errno != EAGAIN)
-              perror ("recv");
-          }
-          else {
-            rdt_recvpkt (c->rel, &pkt, len);
-            memset (&pkt, 0xc9, len); /* for debugging */
-          }
-        }
-      }
+void twheel_run (struct twheel *w, uint64_t now) {
+  while ((int64_t) (now - w->now) >= 0) {
+    int index = w->now & (WHEEL_SLOTS - 1);
+    struct rtimer **head = &w->slot[0][index];
+    struct rtimer *t;
+    int level;
+
+    if (!w->count) {
+      w->now = now + 1;
+      return;
     }
-    if ((cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
-        && evwriters[i])
-      conn_drain (evwriters[i]);
-    if (cevents[i].revents & (POLLHUP|POLLERR)) {
-      /* If stderr has an error, the tester has probably died, so exit
-       * immediately. */
-      if (cevents[i].fd == 2)
-        exit (1);
-      cevents[i].fd = -1;
+    for (level = 1; !index && level < WHEEL_LEVELS; level++)
+      index = twheel_cascade (w, level,
+          (w->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    w->now++;
+
+    /* callbacks may arm or cancel other timers, so pop one at a time */
+    while ((t = *head)) {
+      timer_unlink (t);
+      w->count--;
+      t->fn (t->arg);
     }
-    cevents[i].revents = 0;
-  }
-
-  if (need_timer_in (&last_timeout, cc->timer) == 0) {
-    rdt_timer ();
-    clock_gettime (CLOCK_MONOTONIC, &last_timeout);
-  }
-
-  for (c = conn_list; c; c = nc) {
-    nc = c->next;
-    if (c->delete_me && (c->write_err || !c->outq))
-      conn_free (c);
   }
 }
 
 
 
 /**
- * cksum() - calculates 16-bit checksum on a data buffer
- * @param _data - data to checksum
- * @param len - size of buffer
- * @returns 1's complement checksum value
+ * twheel_next() - finds how long the wheel can sleep
+ * @param w - timing wheel
+ * @returns ms until the earliest bucket is due, 0 if overdue, -1 if empty
  */
-uint16_t cksum (const void *_data, int len) {
-  const uint8_t *data = _data;
-  uint32_t sum;
+long twheel_next (const struct twheel *w) {
+  uint64_t next = 0;
+  int64_t left;
+  int level, k;
+
+  if (!w->count)
+    return -1;
+
+  /* at level 0 a bucket k ticks ahead holds timers due then; above
+   * that, the first occupied bucket is the earliest point at which
+   * something gets cascaded and may need to be re-examined */
+  for (level = 0; level < WHEEL_LEVELS; level++) {
+    int shift = WHEEL_BITS * level;
+    uint64_t base = w->now >> shift;
+    /* the current bucket is only still to come on a cascade boundary */
+    int first = (w->now & (((uint64_t) 1 << shift) - 1)) ? 1 : 0;
+    for (k = first; k < first + WHEEL_SLOTS; k++) {
+      if (w->slot[level][(base + k) & (WHEEL_SLOTS - 1)]) {
+        uint64_t at = (base + k) << shift;
+        if (!next || at < next)
+          next = at;
+        break;
+      }
+    }
+  }
 
-  for (sum = 0;len >= 2; data += 2, len -= 2)
-    sum += data[0] << 8 | data[1];
-  if (len > 0)
-    sum += data[0] << 8;
-  while (sum > 0xffff)
-    sum = (sum >> 16) + (sum & 0xffff);
-  sum = htons (~sum);
-  return sum ? sum : 0xffff;
+  left = next - clock_ms ();
+  if (left < 0)
+    return 0;
+  return left;
 }
 
 
@@ -861,6 +2915,13 @@ int listen_on (int dgram, struct sockaddr_storage *ss) {
   }
   if (!dgram)
     setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof (n));
+  /* server workers each bind their own socket to the one port */
+  else if (opt_workers > 1
+      && setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &n, sizeof (n)) < 0) {
+    perror ("SO_REUSEPORT");
+    close (s);
+    return -1;
+  }
   if (bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0) {
     perror ("bind");
     close (s);
@@ -928,24 +2989,187 @@ int connect_to (int dgram, const struct sockaddr_storage *ss) {
 
 
 /**
- * debug_recv() - wrapper on recv()
+ * debug_recvgro() - debug_recvmmsg for a socket with UDP_GRO enabled
  * @param s - socket to recv from
- * @param buf - buffer to recv into
- * @param len - max size of buffer
- * @param flags - recv flags
- * @param from - returned sockaddr containing peer information
- * @returns # of bytes read or -1 on error
- */
-static int debug_recv (int s, packet_t *buf, size_t len, int flags, struct sockaddr_storage *from) {
-  socklen_t socklen = sizeof (*from);
-  int n;
-  if (from)
-    n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
-  else
-    n = recv (s, buf, len, flags);
-  if (opt_debug)
-    print_pkt (buf, "recv", n);
-  return n;
+ * @param pkts - buffers to split the datagrams into
+ * @param lens - returned size of each packet
+ * @param from - returned sockaddr of each peer, NULL if connected
+ * @param n - number of buffers, enough for a whole GRO burst
+ * @returns # of packets read or -1 on error
+ *
+ * The kernel may hand back a burst of back-to-back datagrams from one
+ * peer as a single buffer, along with the size they all share but the
+ * last; this splits it back into packets.
+ */
+static int debug_recvgro (int s, packet_t *pkts, int *lens,
+    struct sockaddr_storage *from, int n) {
+  const size_t bufsize = 65536;
+  union {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } ctl;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  int i, r, off, seg;
+
+  if (!wk->grobuf)
+    wk->grobuf = xmalloc (bufsize);
+  iov.iov_base = wk->grobuf;
+  iov.iov_len = bufsize;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof (ctl.buf);
+  if (from) {
+    msg.msg_name = &from[0];
+    msg.msg_namelen = sizeof (from[0]);
+  }
+  if ((r = recvmsg (s, &msg, MSG_DONTWAIT)) < 0) {
+    if (opt_debug)
+      print_pkt (pkts, "recv", r);
+    return r;
+  }
+
+  seg = r;
+  for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm))
+    if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO)
+      memcpy (&seg, CMSG_DATA (cm), sizeof (seg));
+  if (seg <= 0)
+    seg = r;
+
+  for (i = 0, off = 0; i < n && (off < r || i == 0); i++, off += seg) {
+    lens[i] = r - off < seg ? r - off : seg;
+    /* like recv, truncate anything longer than a packet */
+    if (lens[i] > sizeof (pkts[i]))
+      lens[i] = sizeof (pkts[i]);
+    memcpy (&pkts[i], wk->grobuf + off, lens[i]);
+    if (from && i)
+      from[i] = from[0];
+    if (opt_debug)
+      print_pkt (&pkts[i], "recv", lens[i]);
+  }
+  return i;
+}
+
+
+
+/**
+ * debug_recvmmsg() - wrapper on recvmmsg()
+ * @param s - socket to recv from
+ * @param pkts - buffers to recv into, one per datagram
+ * @param lens - returned size of each datagram
+ * @param from - returned sockaddr of each peer, NULL if connected
+ * @param n - number of buffers
+ * @returns # of datagrams read or -1 on error
+ */
+static int debug_recvmmsg (int s, packet_t *pkts, int *lens,
+    struct sockaddr_storage *from, int n) {
+  struct mmsghdr msg[RECV_BATCH];
+  struct iovec iov[RECV_BATCH];
+  int i, r;
+
+  assert (n <= RECV_BATCH);
+  if (opt_gso)
+    return debug_recvgro (s, pkts, lens, from, n);
+  memset (msg, 0, n * sizeof (msg[0]));
+  for (i = 0; i < n; i++) {
+    iov[i].iov_base = &pkts[i];
+    iov[i].iov_len = sizeof (pkts[i]);
+    msg[i].msg_hdr.msg_iov = &iov[i];
+    msg[i].msg_hdr.msg_iovlen = 1;
+    if (from) {
+      msg[i].msg_hdr.msg_name = &from[i];
+      msg[i].msg_hdr.msg_namelen = sizeof (from[i]);
+    }
+  }
+  r = recvmmsg (s, msg, n, MSG_DONTWAIT, NULL);
+  if (r < 0 && opt_debug)
+    print_pkt (pkts, "recv", r);
+  for (i = 0; i < r; i++) {
+    lens[i] = msg[i].msg_len;
+    if (opt_debug)
+      print_pkt (&pkts[i], "recv", lens[i]);
+  }
+  return r;
+}
+
+
+
+/**
+ * udp_offload() - asks for GRO bursts on a UDP socket if -g was given
+ * @param s - UDP socket
+ */
+static void udp_offload (int s) {
+  int on = 1;
+
+  if (opt_gso && setsockopt (s, IPPROTO_UDP, UDP_GRO, &on, sizeof (on)) < 0)
+    perror ("UDP_GRO");
+}
+
+
+
+/**
+ * worker_init() - makes a worker the calling thread's event loop
+ * @param w - the worker, zeroed
+ *
+ * Each worker has its own io_uring or epoll instance; if io_uring was
+ * asked for but will not start, it falls back as the first one did.
+ */
+static void worker_init (struct worker *w) {
+  wk = w;
+#if HAVE_EPOLL
+  w->epoll_fd = -1;
+#endif
+  if (opt_uring && uring_init () == 0)
+    return;
+#if HAVE_EPOLL
+  if (!opt_poll && (w->epoll_fd = epoll_create1 (EPOLL_CLOEXEC)) >= 0)
+    /* Do catch errors on stderr */
+    ev_add (&w->stderr_src, NULL, 2, 0);
+#endif
+}
+
+
+
+/**
+ * worker_serve() - runs a server worker's event loop on its own socket
+ * @param w - the calling thread's worker
+ */
+static void worker_serve (struct worker *w) {
+  make_async (w->udp_socket);
+  udp_offload (w->udp_socket);
+#if HAVE_EPOLL
+  if (w->epoll_fd >= 0
+      && ev_add (&w->server_src, NULL, w->udp_socket, EPOLLIN) < 0) {
+    perror ("epoll_ctl");
+    exit (1);
+  }
+#endif
+#if HAVE_IO_URING
+  if (w->uring)
+    uring_listen (w->udp_socket);
+#endif
+  conn_mkevents ();
+  w->cevents[0].fd = w->udp_socket;
+  w->cevents[0].events = POLLIN;
+  for (;;)
+    conn_poll (&serverconf->c);
+}
+
+
+
+/**
+ * worker_thread() - start routine of every server worker but the first
+ * @param arg - the worker
+ */
+static void *worker_thread (void *arg) {
+  struct worker *w = arg;
+
+  worker_init (w);
+  worker_serve (w);
+  return NULL;
 }
 
 
@@ -955,7 +3179,11 @@ static int debug_recv (int s, packet_t *buf, size_t len, int flags, struct socka
  */
 static void usage (void) {
   fprintf (stderr,
-      "usage: %s udp-port [host:]udp-port\n", progname);
+      "usage: %s [-cdgimpu] [-w window] [-t timeout] [-b bytes]"
+      " [-C algorithm] [-D dupacks] udp-port [host:]udp-port\n"
+      "       %s -s [-cdgmpu] [-w window] [-t timeout] [-b bytes]"
+      " [-C algorithm] [-D dupacks] [-n workers] udp-port [host:]tcp-port\n",
+      progname, progname);
   exit (1);
 }
 
@@ -965,15 +3193,29 @@ int main (int argc, char **argv) {
   struct option o[] = {
     { "debug", no_argument, NULL, 'd' },
     { "window", required_argument, NULL, 'w' },
+    { "timeout", required_argument, NULL, 't' },
+    { "server", no_argument, NULL, 's' },
+    { "poll", no_argument, NULL, 'p' },
+    { "uring", no_argument, NULL, 'u' },
+    { "gso", no_argument, NULL, 'g' },
+    { "crc32c", no_argument, NULL, 'c' },
+    { "buffer", required_argument, NULL, 'b' },
+    { "mmap", no_argument, NULL, 'm' },
+    { "workers", required_argument, NULL, 'n' },
+    { "iothread", no_argument, NULL, 'i' },
+    { "congestion", required_argument, NULL, 'C' },
+    { "dupacks", required_argument, NULL, 'D' },
     { NULL, 0, NULL, 0 }
   };
   int opt;
+  int opt_server = 0;
+  int nfd;
   char *local = NULL;
   char *remote = NULL;
 	struct config_common c;
   struct sigaction sa;
 	struct sockaddr_storage sl, sr;
-	conn_t *cn = conn_alloc ();
+	conn_t *cn;
 
   // Ignore SIGPIPE, since we may get a lot of these
   memset (&sa, 0, sizeof (sa));
@@ -983,6 +3225,7 @@ int main (int argc, char **argv) {
   memset (&c, 0, sizeof (c));
   c.window = 1;
   c.timeout = 2000;
+  c.dupthresh = 3;
 
   progname = strrchr (argv[0], '/');
   if (progname)
@@ -990,7 +3233,7 @@ int main (int argc, char **argv) {
   else
     progname = argv[0];
 
-  while ((opt = getopt_long (argc, argv, "dlt:w:", o, NULL)) != -1)
+  while ((opt = getopt_long (argc, argv, "b:C:cD:dgilmn:pst:uw:", o, NULL)) != -1)
     switch (opt) {
       case 'd':
         opt_debug = 1;
@@ -1014,37 +3257,123 @@ int main (int argc, char **argv) {
       case 't':
         c.timeout = atoi (optarg);
         break;
+      case 's':
+        opt_server = 1;
+        break;
+      case 'p':
+        opt_poll = 1;
+        break;
+      case 'u':
+        opt_uring = 1;
+        break;
+      case 'g':
+        opt_gso = 1;
+        break;
+      case 'c':
+        c.crc32c = 1;
+        break;
+      case 'b':
+        opt_outbuf = strtoul (optarg, NULL, 0);
+        break;
+      case 'm':
+        opt_mmap = 1;
+        break;
+      case 'n':
+        opt_workers = atoi (optarg);
+        break;
+      case 'i':
+        opt_iothread = 1;
+        break;
+      case 'C':
+        if (!(c.cong = cong_find (optarg))) {
+          const struct cong_ops *ops;
+          fprintf (stderr, "%s: no congestion control %s; try", progname,
+              optarg);
+          for (ops = cong_algos; ops->name; ops++)
+            fprintf (stderr, " %s", ops->name);
+          fprintf (stderr, "\n");
+          exit (1);
+        }
+        break;
+      case 'D':
+        c.dupthresh = atoi (optarg);
+        break;
       default:
         usage ();
         break;
     }
 
-  if (optind + 2 != argc || c.window < 1 || c.timeout < 10)
+  /* the budget must fit at least one full packet of output */
+  if (optind + 2 != argc || c.window < 1 || c.timeout < 10
+      || c.dupthresh < 0
+      || opt_outbuf < sizeof (((packet_t *) 0)->data)
+      || opt_workers < 1 || (opt_workers > 1 && !opt_server)
+      || (opt_iothread
+          && (opt_server || opt_uring || opt_mmap)))
     usage ();
-  c.timer = c.timeout / 5;
   local = argv[optind];
   remote = argv[optind+1];
 
+  workers = xmalloc (opt_workers * sizeof (*workers));
+  memset (workers, 0, opt_workers * sizeof (*workers));
+  worker_init (&workers[0]);
+#if HAVE_IO_URING
+  if (!wk->uring)
+#endif
+    opt_uring = 0;
+  /* the io_uring engine posts packet-sized receives of its own */
+  if (opt_uring)
+    opt_gso = 0;
+
+  /* Server: each worker has its own UDP socket on the port, shared by
+   * the clients the kernel hashes to it, each of which is relayed to
+   * its own TCP connection to remote. */
+  if (opt_server) {
+    int i;
+
+    serverconf = xmalloc (sizeof (*serverconf));
+    memset (serverconf, 0, sizeof (*serverconf));
+    serverconf->c = c;
+    if ((get_address (&serverconf->dest, 0, 0, AF_INET, remote) < 0)
+        || (get_address (&sl, 1, 1, serverconf->dest.ss_family, local) < 0))
+      exit (1);
+    /* the first bind fills in the port if it was 0; the rest share it */
+    for (i = 0; i < opt_workers; i++)
+      if ((workers[i].udp_socket = listen_on (1, &sl)) < 0)
+        exit (1);
+    /* pick the checksum kernels before there are threads to race */
+    cksum (NULL, 0);
+    crc32c (0, NULL, 0);
+    for (i = 1; i < opt_workers; i++) {
+      workers[i].id = i;
+      if ((errno = pthread_create (&workers[i].thread, NULL,
+              worker_thread, &workers[i]))) {
+        perror ("pthread_create");
+        exit (1);
+      }
+    }
+    worker_serve (&workers[0]);
+  }
+
 	c.single_connection = 1;
-	cn->rfd = 0;
-	cn->wfd = 1;
 	if ((get_address (&sr, 0, 1, AF_INET, remote) < 0)
 									|| (get_address (&sl, 1, 1, sr.ss_family, local) < 0)
-									|| ((cn->nfd = listen_on (1, &sl)) < 0))
+									|| ((nfd = listen_on (1, &sl)) < 0))
     exit (1);
-	if (connect (cn->nfd, (struct sockaddr *) &sr, addrsize (&sr)) < 0) {
+	if (connect (nfd, (struct sockaddr *) &sr, addrsize (&sr)) < 0) {
 					perror ("connect");
 					exit (1);
 	}
-	cn->server = 0;
+	make_async (0);
+	make_async (1);
+	make_async (nfd);
+	udp_offload (nfd);
+	cn = conn_alloc (0, 1, nfd, 0);
 	cn->peer = sr;
-	make_async (cn->rfd);
-	make_async (cn->wfd);
-	make_async (cn->nfd);
 	cn->rel = rdt_create (cn, NULL, &c);
 
 	conn_mkevents ();
-	while (conn_list)
+	while (wk->conn_list)
 					conn_poll (&c);
 
   return 0;
@@ -52,6 +52,24 @@
 
    - data:  Contains (len - 12) bytes of payload data for the
             application.
+
+   Extended Ack packets:
+
+   An Ack packet may be longer than 8 bytes when the receiver is
+   holding packets beyond ackno that arrived out of order.  Such a
+   packet has a seqno field of 0 (which no Data packet can have) and
+   is followed by 1 to MAX_SACK_BLOCKS selective acknowledgement
+   blocks, so its len is 12 + 8 * # of blocks.  Each block names a
+   run of seqnos [start, end) that the receiver already has; the
+   sender need not retransmit those.  Like every other header field,
+   start and end are in big-endian order.
+
+   CRC32C mode (-c):
+
+   Both ends must be run with -c.  Every packet is then followed on the
+   wire by a 4-byte big-endian CRC32C of its first len bytes, which is
+   not counted in len, and the cksum field is sent as 0.  Data packets
+   carry at most 496 bytes of data so that they still fit in 512.
  */
 
 
@@ -71,6 +89,22 @@ struct packet {
 };
 typedef struct packet packet_t;
 
+/* Extended Ack packets carry SACK blocks after a zero seqno */
+#define MAX_SACK_BLOCKS 4
+
+struct sack_block {
+  uint32_t start;		/* First seqno held by the receiver */
+  uint32_t end;			/* One past the last seqno in the run */
+};
+
+struct sack_packet {
+  uint16_t cksum;
+  uint16_t len;
+  uint32_t ackno;
+  uint32_t zero;		/* Always 0, tells it apart from Data */
+  struct sack_block sack[MAX_SACK_BLOCKS];
+};
+
 /* -----------------------------------------------------------------------
 
    Important notes about the library:
@@ -95,7 +129,9 @@ typedef struct packet packet_t;
        - timeout: Tells you what your retransmission timer should be,
                   in milliseconds.  If after this many milliseconds a
                   packet you sent has still not been acknowledged, you
-                  must retransmit the packet.  You may find the
+                  must retransmit the packet.  reliable.c starts each
+                  connection with this value and adapts it to the
+                  measured RTT, never estimating above it.  You may find the
                   function clock_gettime with parameter
                   CLOCK_MONOTONIC useful for keeping track of when
                   packets are sent.  Run "man clock_gettime".
@@ -162,20 +198,26 @@ typedef struct packet packet_t;
      point you can send out more Acks to get more data from the remote
      side.
 
-   * The function rdt_timer is called periodically, currently at a
-     rate 1/5 of the retransmission interval.  You can use this timer
-     to inspect packets and retransmit packets that have not been
-     acknowledged.  Do not retransmit every packet every time the
-     timer is fired!  You must keep track of which packets need to be
-     retransmitted when.
+   * The function rdt_timer is called whenever the deadline reported
+     by rdt_timeout has passed.  The library sleeps in poll() until
+     then (or until I/O arrives), so rdt_timeout should return the
+     number of milliseconds until your earliest retransmission is
+     due, or -1 if nothing is waiting on a timer; an idle process
+     then never wakes up.  You can use this timer to inspect packets
+     and retransmit packets that have not been acknowledged.  Do not
+     retransmit every packet every time the timer is fired!  You must
+     keep track of which packets need to be retransmitted when.
 
 */
 
 struct config_common {
   int window;			/* # of unacknowledged packets in flight */
-  int timer;			/* How often rdt_timer called in milliseconds */
-  int timeout;		/* Retransmission timeout in milliseconds */
+  int timeout;		/* Initial and maximum RTO in milliseconds */
   int single_connection;        /* Exit after first connection failure */
+  int crc32c;			/* Trail packets with a CRC32C, not cksum */
+  const struct cong_ops *cong;	/* Congestion control, NULL for none */
+  int dupthresh;		/* Duplicate acks before a fast retransmit,
+				   0 to wait for the RTO */
 };
 
 typedef struct reliable_state rdt_t;
@@ -187,6 +229,32 @@ extern int opt_debug;		/* When != 0, print packets */
 void *xmalloc (size_t);
 #endif /* !DMALLOC */
 uint16_t cksum (const void *_data, int len); /* compute TCP-like checksum */
+/* cksum after a 32-bit header field changes from one value to another
+ * (both as stored, in network order), without reading the payload */
+uint16_t cksum_update32 (uint16_t sum, uint32_t from, uint32_t to);
+/* cksum of two buffers back to back, given the cksum of each; the first
+ * must be an even # of bytes long */
+uint16_t cksum_concat (uint16_t first, uint16_t second);
+
+/* The kernels cksum() chooses from at run time (in cksum.c), least
+ * preferred first, for benchmarks.  usable is 0 when the CPU lacks the
+ * instructions a kernel needs. */
+struct cksum_impl {
+  const char *name;
+  uint16_t (*fn) (const void *_data, int len);
+  int usable;
+};
+const struct cksum_impl *cksum_impls (void); /* ends with a NULL name */
+
+/* CRC32C (Castagnoli), the stronger check used with -c, and its
+ * kernels, listed the same way */
+uint32_t crc32c (uint32_t crc, const void *data, size_t len); /* crc 0 to start */
+struct crc32c_impl {
+  const char *name;
+  uint32_t (*fn) (uint32_t crc, const void *data, size_t len);
+  int usable;
+};
+const struct crc32c_impl *crc32c_impls (void); /* ends with a NULL name */
 
 
 /* Returns 1 when two addresses equal, 0 otherwise */
@@ -213,8 +281,21 @@ typedef struct conn conn_t;
  * NULL conn_t. */
 conn_t *conn_create (rdt_t *, const struct sockaddr_storage *);
 
-/* Call this function to send a UDP packet to the other side. */
+/* Call this function to send a UDP packet to the other side.  Packets
+ * are batched and leave together once the current event is handled. */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
+/* The same, except that the reflen bytes at ref are sent spliced in
+ * at offset at of pkt, without being copied.  They must stay unchanged
+ * until control returns to the library's event loop. */
+int conn_sendref (conn_t *c, const packet_t *pkt, size_t len,
+		  size_t at, const void *ref, size_t reflen);
+
+/* With -m, input that is a regular file is mapped into memory.  This
+ * returns the part of it conn_input has not read, and its size in
+ * *size, or NULL if the input is not mapped.  The memory stays valid
+ * until the connection is destroyed, so packets can be sent straight
+ * from (and resent from) it with conn_sendref. */
+const char *conn_inmap (conn_t *c, size_t *size);
 
 /* This function tells you how many bytes of output buffering are free
  * for conn_output to store your data.  conn_output is guaranteed not
@@ -258,7 +339,10 @@ void rdt_demux (const struct config_common *cc,
 /* Notification handlers */
 void rdt_read (rdt_t *);    /* Invoked when you can call conn_input */
 void rdt_output (rdt_t *);  /* Invoked when some output drained */
-void rdt_timer (void); /* Invoked roughly each timer/5 milliseconds */
+void rdt_timer (void); /* Invoked once rdt_timeout's deadline passes */
+long rdt_timeout (void); /* ms until rdt_timer is due, -1 if never */
+void rdt_pace (void); /* Invoked once rdt_pace_timeout's deadline passes */
+long rdt_pace_timeout (void); /* the same for paced sends, in microseconds */
 
 
 
@@ -293,3 +377,121 @@ int connect_to (int dgram, const struct sockaddr_storage *ss);
 #if NEED_CLOCK_GETTIME
 int clock_gettime (int, struct timespec *);
 #endif /* NEED_CLOCK_GETTIME */
+
+
+/* Hierarchical timing wheel.  Timers are kept in WHEEL_LEVELS levels
+ * of WHEEL_SLOTS buckets each; level 0 has one-millisecond buckets
+ * and every level above is WHEEL_SLOTS times coarser.  Adding,
+ * cancelling and firing a timer are all O(1); timers in upper levels
+ * are cascaded down as the lower level wraps around.  A struct rtimer
+ * is embedded in whatever object owns the deadline (zero it before
+ * first use), and fn (arg) is called once it expires. */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct rtimer {
+  struct rtimer *next;
+  struct rtimer **prev;		/* NULL when not pending */
+  uint64_t expires;		/* Absolute deadline in milliseconds */
+  void (*fn) (void *arg);
+  void *arg;
+};
+
+struct twheel {
+  uint64_t now;			/* Next millisecond tick to process */
+  size_t count;			/* # of pending timers */
+  struct rtimer *slot[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/* Milliseconds on the CLOCK_MONOTONIC clock, and microseconds. */
+uint64_t clock_ms (void);
+uint64_t clock_us (void);
+
+void twheel_init (struct twheel *w);
+
+/* Arm (or re-arm) t to fire ms milliseconds from now. */
+void timer_set (struct twheel *w, struct rtimer *t, long ms);
+
+/* Disarm t; harmless if it is not pending. */
+void timer_cancel (struct twheel *w, struct rtimer *t);
+
+static inline int timer_pending (const struct rtimer *t) { return t->prev != NULL; }
+
+/* Fire every timer whose deadline is at or before now (clock_ms ()). */
+void twheel_run (struct twheel *w, uint64_t now);
+
+/* Milliseconds until twheel_run has work to do, or -1 if no timer is
+ * pending.  This may undershoot when the next timer still has to be
+ * cascaded down, but it never overshoots. */
+long twheel_next (const struct twheel *w);
+
+
+/* Congestion control (in cong.c).  A struct cong tracks a session's
+ * congestion window in packets; the reliable layer sends at most
+ * min (cong_window (), config_common.window) new packets past the
+ * oldest unacknowledged one, and reports acks, losses and timeouts
+ * through cong_ack, cong_loss and cong_timeout.  It also reports a
+ * delivery rate sample with every ack through cong_rate, and spaces
+ * new packets cong_pacing () apart, if that is non-zero.  Times are
+ * clock_ms () values, RTTs microseconds.  A session without an
+ * algorithm (ops NULL) is limited by the configured window alone. */
+struct cong;
+
+/* What an ack says about the path: the packets delivered between the
+ * newest packet it covers being sent and the ack arriving, as a rate */
+struct rate_sample {
+  double rate;			/* Packets per second */
+  long rtt;			/* That packet's RTT, 0 if retransmitted */
+  uint64_t prior;		/* Delivered count when it was sent */
+  uint64_t delivered;		/* Delivered count now */
+  int inflight;			/* Packets still unacknowledged */
+};
+
+struct cong_ops {
+  const char *name;
+  void (*on_ack) (struct cong *cg, int acked, long srtt, uint64_t now);
+  void (*on_loss) (struct cong *cg, uint64_t now);  /* once per loss event */
+  void (*on_timeout) (struct cong *cg, uint64_t now);
+  void (*on_rate) (struct cong *cg, const struct rate_sample *rs,
+		   uint64_t now);		/* before on_ack; may be NULL */
+};
+
+#define BBR_BW_ROUNDS 10	/* Round trips the bandwidth max spans */
+
+struct cong {
+  const struct cong_ops *ops;
+  double cwnd;			/* Congestion window, packets */
+  double ssthresh;		/* Slow start below this */
+  double limit;			/* The configured window: cwnd stops here */
+  double wmax;			/* CUBIC: cwnd before the last reduction */
+  double origin;		/* CUBIC: the plateau of the current curve */
+  double k;			/* CUBIC: seconds from epoch to origin */
+  double west;			/* CUBIC: what Reno would have by now */
+  uint64_t epoch;		/* CUBIC: start of this curve, 0 if none */
+  double pacing;		/* Packets per second, 0 to send unpaced */
+  double bw_round[BBR_BW_ROUNDS]; /* BBR: max delivery rate of each round */
+  double target;		/* BBR: cwnd the model calls for, 0 if none */
+  long minrtt;			/* BBR: lowest RTT seen lately, 0 if none */
+  uint64_t minrtt_at;		/* BBR: when it was seen */
+  uint64_t round;		/* BBR: round trips so far */
+  uint64_t round_end;		/* BBR: delivered count that ends this one */
+  int mode;			/* BBR: startup, drain, probe_bw, probe_rtt */
+  int cycle;			/* BBR: phase of the probe_bw gain cycle */
+  uint64_t cycle_at;		/* BBR: when the phase began */
+  uint64_t probe_end;		/* BBR: when probe_rtt ends, 0 if unknown */
+  double full_bw;		/* BBR: bandwidth when startup last grew */
+  int full_rounds;		/* BBR: rounds since then without growth */
+};
+
+/* The algorithms -C chooses from, ending with a NULL name. */
+extern const struct cong_ops cong_algos[];
+const struct cong_ops *cong_find (const char *name); /* NULL if unknown */
+
+void cong_init (struct cong *cg, const struct cong_ops *ops, int limit);
+int cong_window (const struct cong *cg);
+void cong_ack (struct cong *cg, int acked, long srtt, uint64_t now);
+void cong_loss (struct cong *cg, uint64_t now);
+void cong_timeout (struct cong *cg, uint64_t now);
+void cong_rate (struct cong *cg, const struct rate_sample *rs, uint64_t now);
+double cong_pacing (const struct cong *cg);	/* packets/s, 0 if unpaced */